@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Times [[ string =~ regex ]] in jsh against spawning grep -E for each match.
+# Both scripts match the same strings against the same pattern, one per line,
+# so the builtin gets the compiled pattern from the cache after the first.
+#
+# usage: bench/regex.sh [jsh] [matches]
+#
+
+jsh=${1:-./jsh}
+matches=${2:-2000}
+pattern='^[a-z]+-[0-9]+\.example\.com$'
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+i=0
+while [ "$i" -lt "$matches" ]; do
+    echo "[[ host-$i.example.com =~ $pattern ]]"
+    i=$((i + 1))
+done > "$dir/builtin.jsh"
+
+i=0
+while [ "$i" -lt "$matches" ]; do
+    echo "echo host-$i.example.com | grep -Eq $pattern"
+    i=$((i + 1))
+done > "$dir/grep.jsh"
+
+# Runs a script with a throwaway HOME so history isn't written, prints its time.
+run() {
+    start=$(date +%s%N)
+    HOME=$dir "$jsh" < "$2" > /dev/null 2>&1
+    end=$(date +%s%N)
+    awk -v label="$1" -v n="$matches" -v ns=$((end - start)) \
+        'BEGIN {printf "%-10s %8.3fs %10.1fus/match\n", label, ns / 1e9, ns / 1e3 / n}'
+}
+
+echo "$matches matches"
+run '[[ =~ ]]' "$dir/builtin.jsh"
+run 'grep -E' "$dir/grep.jsh"
@@ -0,0 +1,55 @@
+// jsh.h interface for running jsh pipelines from other programs.
+//
+// Build the library with:
+//     cc -DJSH_LIBRARY -fPIC -shared -fvisibility=hidden -pthread -o libjsh.so jshell.c
+//
+// Everything but the jsh_ functions below is then kept out of the dynamic
+// symbol table, so a host's own symbols can't replace the shell's internals.
+//
+// Each context has its own PATH, aliases, caches and exit status.
+// Variables, the current directory, the pushd stack and the history file
+// belong to the process and are shared by all contexts, so only one line
+// runs at a time: jsh_run waits for any line running on another thread,
+// and jsh_run_async lines take turns. fds only applies to the commands a
+// line runs, builtins and error messages write to the process's own
+// stdout and stderr.
+
+#ifndef JSH_H
+#define JSH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct jsh_ctx;
+
+// Exported from the library even though it is built with hidden visibility.
+#define JSH_API __attribute__((visibility("default")))
+
+// Called with the exit status when a line run by jsh_run_async finishes.
+typedef void (*jsh_callback)(struct jsh_ctx *ctx, int status, void *data);
+
+// Creates a context, returns NULL if out of memory.
+JSH_API struct jsh_ctx *jsh_ctx_new(void);
+
+// Frees a context, it must not be running anything.
+JSH_API void jsh_ctx_free(struct jsh_ctx *ctx);
+
+//
+// Runs a line such as "sort < in | uniq -c" and returns its exit status.
+// fds gives the stdin, stdout and stderr of the commands, NULL or -1 to inherit.
+//
+JSH_API int jsh_run(struct jsh_ctx *ctx, const char *line, const int fds[3]);
+
+//
+// Runs a line on a new thread and calls callback from that thread when it is done.
+// Returns 0 if the thread could not be started.
+//
+JSH_API int jsh_run_async(struct jsh_ctx *ctx, const char *line, const int fds[3],
+        jsh_callback callback, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
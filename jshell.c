@@ -30,7 +30,66 @@
 // Version 0.9 - Check for invalid pipes.
 //             - Cd with no command takes to home directory.
 //             - Don't allow builtin commands with pipes.
+//
+// Version 0.10 - Parameter expansion with string operators.
+//              - Variable assignment with NAME=value.
+//
+// Version 0.11 - [[ str =~ regex ]] with capture groups in MATCH.
+//              - Exit status of the last command in $?.
+//
+// Version 0.12 - source builtin.
+//              - ~/.jshrc is sourced at startup.
+//              - Lines starting with # are comments.
+//
+// Version 0.13 - alias and unalias builtins.
+//
+// Version 0.14 - exec builtin, including redirection of the shell's own fds.
+//              - Last command of a script replaces the shell.
+//
+// Version 0.15 - Optional PATH index shared between sessions in /dev/shm.
+//
+// Version 0.16 - --save-image and --image to start from a saved rc state.
+//
+// Version 0.17 - Session state moved into a context.
+//              - Library build with the interface in jsh.h.
+//
+// Version 0.18 - JSON events for each command with --events-fd.
+//              - Every stage of a pipeline is waited for.
+//
+// Version 0.19 - stats builtin with latency histograms per command.
+//
+// Version 0.20 - Counters published in /dev/shm/jsh.<pid> for jshstat.
+//
+// Version 0.21 - --profile-pipeline reports the slowest stage of each pipeline.
+//
+// Version 0.22 - a |pv| b meters the pipe between a and b inside the shell.
+//                With set -o pipemeter, otherwise pv is run as usual.
+//
+// Version 0.23 - Programs and their interpreters are paged in while a line is expanded.
+//
+// Version 0.24 - coproc NAME cmd, read [-u fd] and > &fd redirection.
+//
+// Version 0.25 - remote builtin runs jobs on jsh --worker processes.
+//
+// Version 0.26 - Words are classified once so only the expansions they need are done.
+//
+// Version 0.27 - Globs go into one string pool, radix sorted, set -o nosortglob.
+//
+// Version 0.28 - find builtin walks directories on several threads.
+//
+// Version 0.29 - History designators !-n !prefix !?str? !$ !* !! and ^old^new.
+//
+// Version 0.30 - ~/.jshell_history.log and history --top/--slowest/--failed/--since/--cwd.
+//
+// Version 0.31 - Large sourced files are tokenized on several threads while they run.
+//
+// Version 0.32 - ; && || lists, ( ... ) subshells and { ...; } groups.
+//
+// Version 0.33 - JSH_LOG_OUTPUT=file logs every command's output with tee and splice.
+//
+// Version 0.34 - Relative paths resolve from a cached directory descriptor, pushd and popd.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,8 +99,30 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <signal.h>
+#include <elf.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <spawn.h>
 #include <glob.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <regex.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include "jsh.h"
+#include "jshstat.h"
 
 #define MAX_LINE_CHARS 1024
 #define INTERACTIVE_PROMPT "$ " 
@@ -49,6 +130,8 @@
 #define WORD_SEPARATORS " \t\r\n"
 #define DEFAULT_HISTORY_SHOWN 10
 #define PATH_BUFF_SIZE 1024
+#define RC_FILE ".jshrc"
+#define MAX_SOURCE_DEPTH 32
 
 // Defines for the last_n_commands function.
 #define EXECUTE 1
@@ -58,52 +141,762 @@
 #define NONE   0
 #define STORE  1
 #define APPEND 2
+#define DUPLICATE 3
+
+// These characters are always returned as single words, unless escaped with a backslash.
+#define SPECIAL_CHARS "!><|();"
+
+// How the command after a ; && or || in a list is run.
+#define LIST_ALWAYS 0
+#define LIST_AND 1
+#define LIST_OR 2
+
+// Size of each block handed out by the expansion arena.
+#define ARENA_BLOCK_SIZE 4096
+
+// Number of compiled regular expressions kept for =~.
+#define REGEX_CACHE_SIZE 32
+#define MAX_MATCH_GROUPS 10
+
+// Shared PATH index, used when JSH_PATH_INDEX is set.
+#define PATH_INDEX_DIR "/dev/shm"
+#define PATH_INDEX_MAGIC 0x4a534850
+#define PATH_INDEX_VERSION 1
+#define PATH_INDEX_CHECK_SECONDS 1
+
+// Startup image of the state left behind by ~/.jshrc.
+#define IMAGE_MAGIC 0x4a534849
+#define IMAGE_VERSION 1
+
+// Events waiting for a slow reader are dropped past this size.
+#define EVENT_BUFFER_MAX (1 << 20)
+
+//
+// Latency histograms, in microseconds. Values below 16 get a bucket each,
+// above that every power of two is split into 16 buckets, so a bucket is
+// never more than 1/16 wider than its values, up to about 12 days.
+//
+#define STATS_MAX_COMMANDS 64
+#define STATS_NAME_CHARS 32
+#define STATS_SUB_BUCKETS 16
+#define STATS_BUCKETS 608
+#define STATS_WALL 0
+#define STATS_SPAWN 1
+#define STATS_INPUT 2
+#define STATS_METRICS 3
+
+// How often --profile-pipeline samples the stages and pipes.
+#define PROFILE_INTERVAL_MS 20
+
+// With set -o pipemeter, a stage that is just this word meters the pipe it sits in.
+#define METER_WORD "pv"
+
+// Frame types sent between remote and jsh --worker.
+#define FRAME_JOB 'J'
+#define FRAME_QUIT 'Q'
+#define FRAME_READY 'R'
+#define FRAME_STDOUT 'O'
+#define FRAME_STDERR 'E'
+#define FRAME_EXIT 'X'
+#define FRAME_HEADER_SIZE 5
+#define FRAME_MAX_PAYLOAD (1 << 20)
+
+// What a word contains, so each expansion stage can skip words it has nothing to do for.
+#define WORD_WILDCARD 1
+#define WORD_TILDE 2
+#define WORD_VARIABLE 4
+#define WORD_ESCAPE 8
+
+// Glob sorting, buckets smaller than this are insertion sorted,
+// and lists at least GLOB_PARALLEL_MIN long are sorted on several threads.
+#define GLOB_INSERTION_MAX 32
+#define GLOB_RADIX_DEPTH 32
+#define GLOB_PARALLEL_MIN 65536
+#define GLOB_MAX_THREADS 8
+
+// find builtin, predicates and actions in an expression.
+#define FIND_MAX_THREADS 8
+#define FIND_BUFFER_SIZE 65536
+#define FIND_OR 0
+#define FIND_NAME 1
+#define FIND_PATH 2
+#define FIND_TYPE 3
+#define FIND_NEWER 4
+#define FIND_SIZE 5
+#define FIND_MTIME 6
+#define FIND_PRUNE 7
+#define FIND_PRINT 8
+#define FIND_PRINT0 9
+
+// Characters of each command indexed by the history prefix trie.
+#define HISTORY_TRIE_DEPTH 16
+
+// History analytics, tables with fewer rows than HISTORY_SEGMENT_MIN are scanned on one thread.
+#define HISTORY_LOG ".jshell_history.log"
+#define HISTORY_MAX_THREADS 8
+#define HISTORY_SEGMENT_MIN 65536
+
+// Sourced files at least this big are mapped and tokenized in parallel.
+#define PARSE_PARALLEL_MIN (1 << 20)
+#define PARSE_MAX_THREADS 8
+
+// Most bytes the output logger moves per tee.
+#define OUTPUT_LOG_CHUNK 65536
+
+// How many more times the logger moves output after the command is reaped.
+#define OUTPUT_LOG_DRAIN_ROUNDS 16
+
+// Number of buckets in the alias hash table.
+#define ALIAS_TABLE_SIZE 64
+
+// Expansion results live in a chain of blocks that is released after each command.
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+};
+
+// Compiled patterns for =~, the least recently used one is replaced when full.
+struct regex_entry {
+    char *pattern;
+    unsigned long hash;
+    unsigned long last_used;
+    regex_t regex;
+};
+
+// Aliases keep their value tokenized so expanding them is just a copy.
+struct alias {
+    char *name;
+    char *value;
+    char **tokens;
+    struct alias *next;
+};
+
+// A coprocess, the shell keeps the write end of its stdin and read end of its stdout.
+struct coproc {
+    char *name;
+    pid_t pid;
+    int in;
+    int out;
+    struct coproc *next;
+};
+
+//
+// Every path globbed for one command, kept in a single buffer.
+// offsets[i] is where path i starts in strings, words is the command's
+// words with the paths put in, built once globbing is done.
+//
+struct glob_pool {
+    char *strings;
+    size_t used;
+    size_t size;
+    size_t *offsets;
+    size_t count;
+    size_t capacity;
+    char **words;
+};
+
+// Shared by the threads sorting the top level buckets of a glob.
+struct glob_sort_job {
+    size_t *offsets;
+    size_t *scratch;
+    char *strings;
+    size_t starts[257];
+    int next_bucket;
+};
+
+// One test in a find expression, tests are ANDed until a FIND_OR.
+struct find_test {
+    int kind;
+    char *pattern;
+    int type;
+    int sign;
+    long long number;
+    long long unit;
+    struct timespec newer;
+};
+
+// A directory waiting to be read by the find threads.
+struct find_dir {
+    struct find_dir *next;
+    char path[];
+};
+
+// A file find is looking at, it is only stat'd if a test needs it.
+struct find_entry {
+    char *path;
+    size_t path_length;
+    char *name;
+    int dir_fd;
+    int type;
+    int have_stat;
+    struct stat st;
+    int prune;
+};
+
+// Output collected by one thread, written out a directory at a time.
+struct find_output {
+    char buffer[FIND_BUFFER_SIZE];
+    size_t used;
+};
+
+// Shared by the find threads.
+struct find_walk {
+    struct find_test *tests;
+    int test_count;
+    int has_action;
+    time_t now;
+    int out_fd;
+    int failed;
+
+    // The directory relative start paths are opened from.
+    int cwd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct find_dir *queue;
+    int busy;
+
+    pthread_mutex_t output_lock;
+};
 
-// These characters are always returned as single words
-#define SPECIAL_CHARS "!><|"
+//
+// Everything a session changes lives in a context, so that several can
+// run in one process through the library interface in jsh.h.
+// The context being run is per thread.
+//
+struct jsh_ctx {
+    char **path;
+
+    // Exit status of the last command, shown by $?.
+    int last_status;
+
+    // Descriptors commands get as stdin, stdout and stderr, -1 to inherit.
+    int fds[3];
+
+    // Library contexts must not exit, exec or print exit statuses.
+    int embedded;
+
+    // Sourced files are not written to the history.
+    int record_history;
+    int source_depth;
+
+    // Set while running the last line of a script, so it can be exec'd directly.
+    int tail_exec;
+
+    // Set in the child running a ( ... ) subshell.
+    int subshell;
+
+    // When the line being run was read, for the input to spawn latency.
+    struct timespec line_time;
+
+    struct arena_block *arena_head;
+    struct alias *alias_table[ALIAS_TABLE_SIZE];
+    struct regex_entry regex_cache[REGEX_CACHE_SIZE];
+    unsigned long regex_clock;
+
+    // Number of MATCH_n variables set by the last =~, so stale ones can be unset.
+    int match_groups_set;
+
+    struct coproc *coprocs;
+
+    // HOME for tilde expansion, dropped whenever HOME is assigned.
+    char *home;
+
+    // set -o nosortglob, globs are left in directory order.
+    int nosortglob;
+
+    // set -o pipemeter, a bare pv stage is replaced by the shell's own meter.
+    int pipemeter;
+
+    // What prefetch_commands found for the line about to run, each name
+    // followed by its path, so get_full_path doesn't search PATH again.
+    char **resolved;
+
+    // The command store_command() recorded, logged with its timing once it is done.
+    char *logged_command;
+    char *logged_cwd;
+    struct timespec logged_start;
+};
+
+static struct jsh_ctx shell_ctx = { .fds = {-1, -1, -1}, .record_history = 1 };
+static _Thread_local struct jsh_ctx *ctx = &shell_ctx;
+
+//
+// The PATH index is one file mapped read-only by every session:
+// header, dir mtimes[dir_count], slots[slot_count], then the strings.
+// Offsets are relative to the start of the file so any session can map it.
+//
+struct path_index_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int dir_count;
+    unsigned int slot_count;
+    unsigned int key;
+    unsigned int size;
+};
+
+struct path_index_dir {
+    long mtime_sec;
+    long mtime_nsec;
+};
+
+// A name offset of 0 marks an empty slot.
+struct path_index_slot {
+    unsigned int name;
+    unsigned int dir;
+};
+
+static struct path_index_header *path_index = NULL;
+static time_t path_index_checked = 0;
+static char **path_index_path = NULL;
+static char *path_index_key = NULL;
+static pthread_mutex_t path_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// A startup image is one file mapped read-only and used in place:
+// header, files[file_count], env[env_count], aliases[alias_count], strings.
+// Every reference is an offset from the start of the file.
+//
+struct image_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;
+    unsigned int file_count;
+    unsigned int env_count;
+    unsigned int alias_count;
+};
+
+// A file sourced while the image was saved, with a hash of its contents.
+struct image_file {
+    unsigned int path;
+    unsigned long hash;
+};
+
+struct image_alias {
+    unsigned int name;
+    unsigned int value;
+};
+
+// Events are buffered so a slow reader of --events-fd never blocks the shell.
+static int events_fd = -1;
+static char *event_buffer = NULL;
+static size_t event_buffer_used = 0;
+static unsigned long events_dropped = 0;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct histogram {
+    unsigned long count;
+    unsigned long max;
+    unsigned int buckets[STATS_BUCKETS];
+};
+
+// Wall time, fork to exec, and line read to spawn, for one command name.
+struct command_stats {
+    char name[STATS_NAME_CHARS];
+    struct histogram metrics[STATS_METRICS];
+};
+
+// Fixed size, once full further commands are counted under the last entry.
+static struct command_stats command_stats[STATS_MAX_COMMANDS];
+static int command_stats_count = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters for jshstat, NULL until metrics_open maps the page.
+static struct jsh_stats_page *metrics_page = NULL;
+static char metrics_path[PATH_BUFF_SIZE];
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// History prefix trie, children are a list of siblings. newest is the
+// newest command whose first characters lead to this node.
+//
+struct history_node {
+    struct history_node *child;
+    struct history_node *sibling;
+    size_t newest;
+    unsigned char key;
+};
+
+// Files waiting for the prefetch thread, which is started once and sleeps
+// until prefetch_commands hands it the next line's programs.
+static char **prefetch_queue = NULL;
+static int prefetch_started = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_ready = PTHREAD_COND_INITIALIZER;
+
+// O_PATH descriptor for the current directory, so relative paths are looked
+// up from it instead of walked again, and the pushd stack of earlier ones.
+static int cwd_fd = -1;
+static int *dir_stack = NULL;
+static int dir_stack_count = 0;
+static int dir_stack_capacity = 0;
+
+// The history file in memory, loaded the first time a designator needs it.
+static char **history_lines = NULL;
+static size_t history_count = 0;
+static size_t history_capacity = 0;
+static int history_loaded = 0;
+static struct history_node history_root;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// The history log as columns, one entry per row. Commands are offsets into
+// text, program and cwd are numbers into names, which holds each distinct
+// string once. Only the part of the log added since the last query is read.
+//
+struct history_table {
+    size_t rows;
+    size_t capacity;
+    double *start;
+    double *duration;
+    int *status;
+    unsigned int *program;
+    unsigned int *cwd;
+    size_t *command;
+
+    char *text;
+    size_t text_used;
+    size_t text_size;
+
+    char **names;
+    unsigned int name_count;
+    unsigned int *name_slots;
+    unsigned int slot_count;
+
+    off_t log_size;
+};
+
+// What a history query wants, and what one segment of the scan found.
+struct history_scan {
+    struct history_table *table;
+    size_t begin;
+    size_t end;
+    double since;
+    char *cwd_match;
+    int failed;
+    char *match;
+    double *program_time;
+    size_t *program_runs;
+    size_t *slowest;
+    size_t slowest_count;
+    size_t limit;
+};
+
+static struct history_table history_table;
+
+// Part of a sourced file, from begin up to end, tokenized a line at a time.
+struct parse_chunk {
+    char *begin;
+    char *end;
+    char ***commands;
+    size_t count;
+    pthread_t thread;
+    int threaded;
+};
+
+// The shell moves data between two pipes for a |pv| meter with splice.
+struct pipe_meter {
+    int in;
+    int out;
+    long long bytes;
+    double seconds;
+    pthread_t thread;
+};
+
+// A < or > redirect copied on its own thread, so the shell can watch the pipeline meanwhile.
+struct redirect_copy {
+    char **words;
+    int pipe_fds[2];
+    char *file;
+    int redirect;
+    long bytes;
+    pthread_t thread;
+};
+
+//
+// Sits between a command and the terminal when JSH_LOG_OUTPUT is set.
+// pipes[0] and pipes[1] take the command's stdout and stderr, targets are
+// where they would have gone, and the thread copies each to both.
+// Writing to stop_pipe tells the thread the command is done.
+//
+struct output_log {
+    int log_fd;
+    int pipes[2][2];
+    int stop_pipe[2];
+    int targets[2];
+    pthread_t thread;
+};
+
+// One jsh --worker as seen by the remote builtin.
+struct remote_worker {
+    char *address;
+    int read_fd;
+    int write_fd;
+    pid_t pid;
+    int job;
+
+    // Asked for a job when there was none, it gets the next one requeued.
+    int idle;
+    char *buffer;
+    size_t buffer_used;
+    size_t buffer_size;
+};
+
+//
+// A way of reaching workers, chosen by the prefix of the address.
+// open connects remote to a worker, listen accepts coordinators on the worker
+// side and is NULL for transports where the coordinator starts the worker.
+//
+struct transport {
+    char *prefix;
+    int (*open)(char *address, struct remote_worker *worker);
+    int (*listen)(char *address);
+};
+
+// Set by --profile-pipeline.
+static int profile_pipeline = 0;
+
+// Files sourced while saving an image, so they can be checked when loading.
+static char **image_sources = NULL;
+static int image_source_count = 0;
+static int image_recording = 0;
 
 // Action functions.
+void run_line(char *line, char **path, char **environment);
+void run_words(char **command_words, char **path, char **environment);
+
+// Command list functions.
+int is_command_list(char **words);
+void run_command_list(char **words, char **path);
+int list_item_end(char **words, int begin, int end);
+int list_connector(char **words, int i, int *width);
+int list_check(char **words, int begin, int end);
+void run_list(char **words, int begin, int end, char **path);
+void run_simple(char **words, int begin, int end, char **path);
+void run_subshell(char **words, int begin, int end, char **path);
+int builtin_only(char **words, int begin, int end);
+void subshell_fork_prepare(void);
+void subshell_fork_parent(void);
+void subshell_fork_child(void);
+void subshell_register(void);
 static void execute_command(char **words, char **path, char **environment);
+int is_builtin(char *name);
 static void do_exit(char **words);
-char **glob_words(char **words, int *is_globbed, glob_t *globbed_data);
+char **glob_words(char **words, int *flags, struct glob_pool *pool);
+void glob_pattern(char *pattern, struct glob_pool *pool);
+void glob_pool_add(struct glob_pool *pool, char *prefix, size_t prefix_length, char *name);
+void glob_pool_free(struct glob_pool *pool);
+void glob_sort(size_t *offsets, size_t count, char *strings);
+void radix_sort(size_t *offsets, size_t *scratch, size_t count, char *strings, size_t depth);
+int compare_glob_paths(const void *a, const void *b, void *arg);
+void *glob_sort_worker(void *arg);
+void set_option(char **words);
+int *option_flag(char *name);
+int thread_count(int max);
+
+// find builtin functions.
+void find(char **words);
+int find_supported(char **words);
+void find_start_name(char *path, char *name, size_t size);
+int find_parse(char **words, struct find_walk *walk);
+int find_matches(struct find_walk *walk, struct find_entry *entry, struct find_output *output);
+int find_stat(struct find_walk *walk, struct find_entry *entry);
+int find_compare(struct find_test *test, long long value);
+void find_push(struct find_walk *walk, struct find_dir *dirs);
+void *find_worker(void *arg);
+void find_read_dir(struct find_walk *walk, char *path, struct find_output *output);
+void find_emit(struct find_walk *walk, struct find_output *output, char *path, size_t length, char end);
+void find_flush(struct find_walk *walk, struct find_output *output);
+int classify_word(char *word);
+char *expand_tilde(char *word);
+void forget_home(char *name);
 void execute_external(char **words, char **environment, char **path);
 
 // built-in Functions.
 void pwd(char **words);
 void cd(char **words);
+void pushd(char **words);
+void popd(char **words);
+void source(char **words, char **path);
+void do_exec(char **words, char **path, char **environment);
+void coproc(char **words, char **path, char **environment);
+void coproc_reap(void);
+void read_line(char **words);
+int source_file(char *file_path, char **path);
+void cwd_init(void);
+int cwd_dir(void);
+int cwd_open(char *directory);
+int cwd_change(int fd);
+void dirs_print(void);
+void source_parallel(char *data, size_t size, char **path);
+void *parse_chunk(void *arg);
 
 // Pipe functions.
 void setup_redirect_output (char **words, int *redirect, int *pipe_file_descriptors, posix_spawn_file_actions_t *actions);
 char **setup_redirect_input (char **words, int *redirect_in, int *pipe_file_descriptors, posix_spawn_file_actions_t *actions, char *in_file);
-void redirect_input(char **words, int *pipe_file_descriptors_in, char *in_file);
-void redirect_output(char **words, int *pipe_file_descriptors_out, int redirect);
+long redirect_input(char **words, int *pipe_file_descriptors_in, char *in_file);
+void *redirect_input_thread(void *arg);
+void *redirect_output_thread(void *arg);
+long redirect_output(char **words, int *pipe_file_descriptors_out, int redirect);
 char **next_pipe(char **words);
 int num_pipes(char **words);
 char **split_words(char **words);
 int valid_pipe(char **words);
 
+// Parameter expansion functions.
+char **expand_words(char **words, int **flags);
+char *expand_word(char *word);
+char *remove_escapes(char *word);
+char *expand_parameter(char *expr);
+int is_assignment(char *word);
+int is_assignment_name(char *word);
+void do_assignment(char **words);
+char *remove_match(char *value, char *pattern, int suffix, int longest);
+char *replace_match(char *value, char *pattern, char *replacement, int all);
+
+// Conditional functions.
+void conditional(char **words);
+int regex_match(char *string, char *pattern);
+regex_t *regex_lookup(char *pattern);
+unsigned long hash_string(char *s);
+
+// Alias functions.
+void alias(char **words);
+void unalias(char **words);
+struct alias *alias_lookup(char *name);
+void alias_set(char *name, char *value);
+char **expand_aliases(char **words);
+
+// Arena functions.
+void *arena_alloc(size_t size);
+char *arena_strndup(char *s, size_t length);
+void arena_mark(struct arena_mark *mark);
+void arena_release(struct arena_mark *mark);
+
 // Helper functions.
 static int is_executable(char *pathname);
 int get_full_path(char *program, char **path, char full_path[MAX_LINE_CHARS]);
 char *get_file_in_home(char *filename);
 int words_length(char **words);
+char *join_words(char **words);
 int line_count_file(FILE *fp);
 void no_redirect (char *program);
 
+// PATH index functions.
+int path_index_lookup(char *program, char **path, char full_path[MAX_LINE_CHARS]);
+void path_index_refresh(char **path, char *key);
+int path_index_fresh(struct path_index_header *index, char **path, char *key);
+void path_index_map(char *file_path);
+int path_index_build(char *file_path, char **path, char *key);
+void path_index_dir_mtime(char *dir, struct path_index_dir *mtime);
+
+// Event functions.
+void event_start(char ***stage_words, pid_t *pids, int stages);
+void event_end(pid_t *pids, int *statuses, struct rusage *usages, int stages,
+        double duration, long bytes_in, long bytes_out);
+void event_write(char *text, size_t length);
+void event_flush(void);
+void json_string(FILE *stream, char *s);
+double time_since(struct timespec *start);
+int wait_stages(pid_t *pids, int stages, int *statuses, struct rusage *usages, struct timespec *exit_times);
+
+// Stats functions.
+void stats(char **words);
+void stats_record(char *program, int metric, double seconds);
+int histogram_bucket(unsigned long value);
+unsigned long histogram_value(int bucket);
+unsigned long histogram_percentile(struct histogram *histogram, double percentile);
+
+// Metrics page functions.
+void metrics_open(void);
+void metrics_close(void);
+void metrics_add(int counter, long delta);
+
+// Prefetch functions.
+void prefetch_commands(char **words, char **path);
+void *prefetch_thread(void *arg);
+void prefetch_file(char *file_path, int depth);
+int find_in_path(char *program, char **path, char full_path[MAX_LINE_CHARS]);
+int find_resolved(char *program, char full_path[MAX_LINE_CHARS]);
+
+// Output logging functions.
+struct output_log *output_log_start(char **words);
+void output_log_finish(struct output_log *log, int status);
+void *output_log_thread(void *arg);
+int output_log_move(struct output_log *log, int stream, int copy_pipe[2]);
+void output_log_lock(int log_fd);
+
+// Remote execution functions.
+void remote(char **words);
+int remote_handle_frame(struct remote_worker *worker, char type, char *payload, unsigned int length,
+        char **jobs, int *queue, int *queue_length, int *statuses, int *attempts);
+int remote_dispatch(struct remote_worker *worker, char **jobs, int *queue, int *queue_length, int *attempts);
+int worker_main(char *address, char **path);
+void worker_serve(int read_fd, int write_fd, char **path);
+int worker_run_job(char *line, int write_fd, char **path);
+struct transport *transport_find(char *address);
+char *transport_address(struct transport *transport, char *address);
+int unix_open(char *address, struct remote_worker *worker);
+int unix_listen(char *address);
+int ssh_open(char *address, struct remote_worker *worker);
+int frame_write(int fd, char type, char *payload, unsigned int length);
+int frame_read(int fd, char *type, char **payload, unsigned int *length);
+int read_full(int fd, char *buffer, size_t length);
+int write_all(int fd, char *buffer, size_t length);
+
+// Pipe meter functions.
+int strip_meters(char **words, int *metered);
+void *meter_thread(void *arg);
+void meter_report(struct pipe_meter *meter, char *from, char *to);
+
+// Pipeline profiling functions.
+void profile_wait(char ***stage_words, pid_t *pids, int stages, int *pipe_array);
+double process_cpu_time(pid_t pid);
+
+// Startup image functions.
+void load_rc(char **path, char *image_path);
+int image_load(char *image_path);
+int image_string(char *base, size_t strings_offset, size_t size, unsigned int offset);
+int image_save(char *image_path, char **old_environment);
+unsigned long hash_file(char *file_path);
+
 // History Functions.
 void last_n_commands(int number, int mode, char **environ, char **path);
 void print_history(char **words);
-void execute_history(char **words, char **environment, char **path);
 void store_command (char **words);
+void history_load(void);
+void history_add(char *line);
+char *history_resolve(char **words);
+char *history_substitute(char **words);
+char **history_expand_words(char **words);
+int history_designator(char **words, int i);
+long history_prefix(char *prefix);
+void run_history(char *line, char **path, char **environment);
+void history_log(void);
+void history_query(char **words);
+int history_table_update(struct history_table *table);
+unsigned int history_intern(struct history_table *table, char *name);
+void *history_scan_segment(void *arg);
+int history_parse_since(char *text, double *since);
+void history_print_row(struct history_table *table, size_t row);
 
 // Token functions.
 static char **tokenize(char *s, char *separators, char *special_chars);
 static void free_tokens(char **tokens);
 
-int main(void) {
+#ifndef JSH_LIBRARY
+int main(int argc, char **argv) {
     //ensure stdout is line-buffered during autotesting
     setlinebuf(stdout);
     setlinebuf(stderr);
+    cwd_init();
 
     // Environment variables are pointed to by `environ', an array of
     // strings terminated by a NULL value -- something like:
@@ -117,6 +910,44 @@ int main(void) {
         pathp = DEFAULT_PATH;
     }
     char **path = tokenize(pathp, ":", "");
+    shell_ctx.path = path;
+
+    char *image_path = NULL;
+    int save_image = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+            save_image = 1;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            return worker_main(argv[i + 1], path);
+        } else if (strcmp(argv[i], "--profile-pipeline") == 0) {
+            profile_pipeline = 1;
+        } else if (strcmp(argv[i], "--events-fd") == 0 && i + 1 < argc) {
+            events_fd = atoi(argv[++i]);
+            if (fcntl(events_fd, F_SETFL, fcntl(events_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+                    fcntl(events_fd, F_SETFD, FD_CLOEXEC) == -1) {
+                perror("--events-fd");
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [--image file | --save-image file] [--events-fd n] [--profile-pipeline] [--worker address]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    metrics_open();
+
+    // Load the user's settings before the first prompt,
+    // from the image if it is still up to date.
+    if (save_image) {
+        load_rc(path, image_path);
+        free_tokens(path);
+        return 0;
+    } else if (image_path == NULL || !image_load(image_path)) {
+        load_rc(path, NULL);
+    }
 
     char *prompt = NULL;
     // if stdout is a terminal, print a prompt before reading a line of input
@@ -124,7 +955,13 @@ int main(void) {
         prompt = INTERACTIVE_PROMPT;
     }
 
+    // Only input that isn't typed is read ahead, a terminal would wait for the next line.
+    int read_ahead = !isatty(0);
+
     // main loop: print prompt, read line, execute command
+    char line[MAX_LINE_CHARS];
+    char next_line[MAX_LINE_CHARS];
+    int have_next_line = 0;
     while (1) {
         if (prompt) {
 	    char buff[PATH_BUFF_SIZE];
@@ -133,130 +970,654 @@ int main(void) {
             fputs(prompt, stdout);
         }
 
-        char line[MAX_LINE_CHARS];
-        if (fgets(line, MAX_LINE_CHARS, stdin) == NULL) {
+        // Give a slow event reader another chance before waiting for input.
+        event_flush();
+
+        if (have_next_line) {
+            strcpy(line, next_line);
+        } else if (fgets(line, MAX_LINE_CHARS, stdin) == NULL) {
             break;
         }
 
-        char **command_words = tokenize(line, WORD_SEPARATORS, SPECIAL_CHARS);
-        execute_command(command_words, path, environ);
-        free_tokens(command_words);
+        // Scripts read one line ahead so the last command can replace the shell.
+        if (read_ahead) {
+            have_next_line = fgets(next_line, MAX_LINE_CHARS, stdin) != NULL;
+            ctx->tail_exec = !have_next_line;
+        }
+
+        run_line(line, path, environ);
     }
 
+    event_flush();
     free_tokens(path);
     return 0;
 }
+#endif
 
 
-//
-// Execute a command, and wait until it finishes.
-//
-//  * `words': a NULL-terminated array of words from the input command line
-//  * `path': a NULL-terminated array of directories to search in;
-//  * `environment': a NULL-terminated array of environment variables.
-//
-static void execute_command(char **words, char **path, char **environment) {
-    assert(words != NULL);
-    assert(path != NULL);
-    assert(environment != NULL);
-    glob_t globbed_data;
-    int is_globbed = 0;
-    int is_redirect = 0;
-
-    if (words [0] == NULL) {
-        // nothing to do
+// Tokenizes a line of input and executes it, lines starting with # are ignored.
+void run_line(char *line, char **path, char **environment) {
+    if (line[strspn(line, WORD_SEPARATORS)] == '#') {
         return;
     }
+    clock_gettime(CLOCK_MONOTONIC, &ctx->line_time);
+    run_words(tokenize(line, WORD_SEPARATORS, SPECIAL_CHARS), path, environment);
+}
 
-    char *program = NULL;
-
-    // Checking if redirection so not to run builtin command.
-    if (strrchr(words[0], '<') == NULL) {
-        program = words[0];
-    } else if (words_length(words) > 2) {
-        program = words[2];
-        is_redirect = 1;
-    } 
-    if (words_length(words) > 2) {
-        if (strcmp(words[words_length(words) - 2], ">" ) == 0) {
-            is_redirect = 1;
+// Runs a tokenized line and frees it, aliases are expanded now as earlier lines may define them.
+void run_words(char **command_words, char **path, char **environment) {
+    // Lines that go in the history can refer back to it.
+    if (ctx->record_history) {
+        command_words = history_expand_words(command_words);
+        if (command_words == NULL) {
+            return;
         }
     }
-    if (num_pipes(words)) {
-        is_redirect = 1;
+    if (is_command_list(command_words)) {
+        run_command_list(command_words, path);
+        free_tokens(command_words);
+    } else {
+        command_words = expand_aliases(command_words);
+        prefetch_commands(command_words, path);
+        execute_command(command_words, path, environment);
+        free_tokens(command_words);
     }
-
-
-    // History commands first so they don't include current command in output.
-    if (strcmp(program, "history") == 0) {
-        if (is_redirect) {no_redirect (program); store_command(words);}
-        else {print_history(words); store_command(words);}
-        return;
-    } else if (strcmp(program, "!") == 0) {
-        if (is_redirect) {no_redirect (program);}
-        else {execute_history(words, environment, path);}
-        return;
+    if (ctx->logged_command != NULL) {
+        history_log();
     }
+}
 
-    // Now store the current command.
-    store_command(words);
-
-    // Expand out anything that needs globbing.
-    words = glob_words(words, &is_globbed, &globbed_data);
 
-    // Other built-in commands.
-    if (strcmp(program, "exit") == 0) {
-        if (is_redirect) {no_redirect (program);}
-        else { do_exit(words); }
-        return;
-    } else if (strcmp(program, "cd") == 0) {
-        if (is_redirect) {no_redirect (program);}
-        else { cd(words); }
-        return;
-    } else if (strcmp(program, "pwd") == 0) {
-        if (is_redirect) {no_redirect (program);}
-        else { pwd(words); }
-        return;
+// True if the line has ; && || or a ( ... ) or { ...; } group to run as a list.
+int is_command_list(char **words) {
+    int length = words_length(words);
+    if (length == 0) {
+        return 0;
     }
+    return strcmp(words[0], "(") == 0 || strcmp(words[0], "{") == 0 ||
+            list_item_end(words, 0, length) != length;
+}
 
-    // If not builtin it must be external.
-    execute_external(words, environment, path);
-
-    // Need to free globbed strings.
-    if (is_globbed) {
-        globfree(&globbed_data);
+//
+// Runs a line that is a list. The line goes in the history once, and the
+// commands in it are not stored again one by one.
+//
+void run_command_list(char **words, char **path) {
+    int length = words_length(words);
+    if (!list_check(words, 0, length)) {
+        ctx->last_status = 2;
+        return;
     }
+    store_command(words);
+    int old_record_history = ctx->record_history;
+    int old_tail_exec = ctx->tail_exec;
+    ctx->record_history = 0;
+    ctx->tail_exec = 0;
+    run_list(words, 0, length, path);
+    ctx->record_history = old_record_history;
+    ctx->tail_exec = old_tail_exec;
 }
 
 //
-// Executes external programs with or without pipes.
-// This also does checking if programs are invalid.
-// Will print error message for invalid pipes.
+// Finds where the command starting at begin ends: the index of the ; && or
+// || after it, or end. ( and { only open groups where a command can start,
+// } only closes one there, and nothing inside [[ ... ]] counts.
 //
-void execute_external(char **words, char **environment, char **path) {
-    if (!valid_pipe(words)) {
-        fprintf(stderr, "invalid pipe\n");
-        return; 
+int list_item_end(char **words, int begin, int end) {
+    int depth = 0;
+    int command_position = 1;
+    int width;
+    for (int i = begin; i < end; i++) {
+        char *word = words[i];
+        if (command_position && strcmp(word, "[[") == 0) {
+            while (i + 1 < end && strcmp(words[i + 1], "]]") != 0) {
+                i++;
+            }
+            i++;
+            command_position = 0;
+        } else if (command_position && (strcmp(word, "(") == 0 || strcmp(word, "{") == 0)) {
+            depth++;
+        } else if (strcmp(word, ")") == 0 || (command_position && depth > 0 && strcmp(word, "}") == 0)) {
+            depth--;
+            command_position = 0;
+        } else if (list_connector(words, i, &width) != -1) {
+            if (depth == 0) {
+                return i;
+            }
+            i += width - 1;
+            command_position = 1;
+        } else {
+            command_position = 0;
+        }
     }
-    // Create in and out pipes for file i/o in case we need them.
-    int pipe_file_in[2];
-    int pipe_file_out[2];
+    return end;
+}
 
-    // Need to store the in file if there is input redirection.
-    char in_file[MAX_LINE_CHARS];
+// The kind of connector at words[i] and how many words it takes, or -1.
+int list_connector(char **words, int i, int *width) {
+    *width = 1;
+    if (strcmp(words[i], ";") == 0) {
+        return LIST_ALWAYS;
+    } else if (strcmp(words[i], "&&") == 0) {
+        return LIST_AND;
+    } else if (strcmp(words[i], "|") == 0 && words[i + 1] != NULL && strcmp(words[i + 1], "|") == 0) {
+        // The tokenizer splits || into two pipes.
+        *width = 2;
+        return LIST_OR;
+    }
+    return -1;
+}
 
-    // Initialize an array for all the pipes between processes.
-    int *pipe_array = NULL;
-    int pipe_num = num_pipes(words);
-    if (pipe_num) {
-        pipe_array = malloc(sizeof(int) * 2 * pipe_num);
-        for (int i = 0; i < pipe_num; i++) {
-            pipe(&pipe_array[i * 2]);
+// Checks a list is well formed before any of it runs, returns 0 after printing an error.
+int list_check(char **words, int begin, int end) {
+    int width;
+    int i = begin;
+    while (1) {
+        int item_end = list_item_end(words, i, end);
+        if (item_end == i) {
+            // Only a ; may be left with nothing after it.
+            if (item_end == end && i > begin && strcmp(words[i - 1], ";") == 0) {
+                return 1;
+            }
+            fprintf(stderr, "syntax error near `%s'\n", i < end ? words[i] : "newline");
+            return 0;
         }
-    }
 
-    // Split words array by the pipes.
-    words = split_words(words);
+        char *first = words[i];
+        char *last = words[item_end - 1];
+        if (strcmp(first, "(") == 0 || strcmp(first, "{") == 0) {
+            char *close = (first[0] == '(') ? ")" : "}";
+            if (strcmp(last, close) != 0 || item_end - i < 3 ||
+                    list_item_end(words, i, item_end - 1) != item_end - 1 ||
+                    (first[0] == '{' && strcmp(words[item_end - 2], ";") != 0)) {
+                fprintf(stderr, "syntax error: `%s' without `%s'\n", first, close);
+                return 0;
+            }
+            if (!list_check(words, i + 1, item_end - 1)) {
+                return 0;
+            }
+        } else {
+            for (int w = i; w < item_end; w++) {
+                if (strcmp(words[w], "(") == 0 || strcmp(words[w], ")") == 0) {
+                    fprintf(stderr, "syntax error near `%s'\n", words[w]);
+                    return 0;
+                }
+                if (strcmp(words[w], "[[") == 0) {
+                    while (w + 1 < item_end && strcmp(words[w + 1], "]]") != 0) {
+                        w++;
+                    }
+                }
+            }
+        }
+
+        if (item_end == end) {
+            return 1;
+        }
+        list_connector(words, item_end, &width);
+        i = item_end + width;
+    }
+}
+
+// Runs the commands of a checked list, && and || look at the last exit status.
+void run_list(char **words, int begin, int end, char **path) {
+    int connector = LIST_ALWAYS;
+    int width;
+    int i = begin;
+    while (i < end) {
+        int item_end = list_item_end(words, i, end);
+        int run = connector == LIST_ALWAYS ||
+                (connector == LIST_AND && ctx->last_status == 0) ||
+                (connector == LIST_OR && ctx->last_status != 0);
+        if (run && strcmp(words[i], "(") == 0) {
+            run_subshell(words, i + 1, item_end - 1, path);
+        } else if (run && strcmp(words[i], "{") == 0) {
+            run_list(words, i + 1, item_end - 1, path);
+        } else if (run) {
+            run_simple(words, i, item_end, path);
+        }
+        if (item_end == end) {
+            break;
+        }
+        connector = list_connector(words, item_end, &width);
+        i = item_end + width;
+    }
+}
+
+// Runs one command of a list as if it were a line of its own.
+void run_simple(char **words, int begin, int end, char **path) {
+    // Assignments earlier in the list may have moved environ.
+    extern char **environ;
+    char **command_words = malloc(sizeof (char *) * (end - begin + 1));
+    for (int i = begin; i < end; i++) {
+        command_words[i - begin] = strdup(words[i]);
+    }
+    command_words[end - begin] = NULL;
+    command_words = expand_aliases(command_words);
+    prefetch_commands(command_words, path);
+    execute_command(command_words, path, environ);
+    free_tokens(command_words);
+}
+
+//
+// Runs a ( ... ) subshell. If the body is only builtins that are safe to undo,
+// it runs in this process with the variables, directory and descriptors
+// put back afterwards. Anything else is run in a forked child.
+//
+void run_subshell(char **words, int begin, int end, char **path) {
+    extern char **environ;
+    if (builtin_only(words, begin, end)) {
+        int environment_count = words_length(environ);
+        char **saved_environment = malloc(sizeof (char *) * (environment_count + 1));
+        for (int i = 0; i <= environment_count; i++) {
+            saved_environment[i] = environ[i] != NULL ? strdup(environ[i]) : NULL;
+        }
+        int saved_cwd = fcntl(cwd_dir(), F_DUPFD_CLOEXEC, 0);
+        int saved_fds[3];
+        memcpy(saved_fds, ctx->fds, sizeof saved_fds);
+        int saved_nosortglob = ctx->nosortglob;
+        int saved_pipemeter = ctx->pipemeter;
+
+        run_list(words, begin, end, path);
+
+        // Unset what the body added, then set everything back.
+        char **added = malloc(sizeof (char *) * (words_length(environ) + 1));
+        int added_count = 0;
+        for (int i = 0; environ[i] != NULL; i++) {
+            size_t name_length = strcspn(environ[i], "=");
+            int found = 0;
+            for (int j = 0; j < environment_count && !found; j++) {
+                found = strncmp(saved_environment[j], environ[i], name_length + 1) == 0;
+            }
+            if (!found) {
+                added[added_count++] = strndup(environ[i], name_length);
+            }
+        }
+        for (int i = 0; i < added_count; i++) {
+            unsetenv(added[i]);
+            free(added[i]);
+        }
+        free(added);
+        for (int i = 0; i < environment_count; i++) {
+            char *equals = strchr(saved_environment[i], '=');
+            if (equals != NULL) {
+                *equals = '\0';
+                setenv(saved_environment[i], equals + 1, 1);
+            }
+            free(saved_environment[i]);
+        }
+        free(saved_environment);
+        forget_home("HOME");
+
+        if (saved_cwd != -1 && !cwd_change(saved_cwd)) {
+            perror("fchdir");
+            close(saved_cwd);
+        }
+        memcpy(ctx->fds, saved_fds, sizeof saved_fds);
+        ctx->nosortglob = saved_nosortglob;
+        ctx->pipemeter = saved_pipemeter;
+        return;
+    }
+
+    static pthread_once_t registered = PTHREAD_ONCE_INIT;
+    pthread_once(&registered, subshell_register);
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The child shares the parent's metrics page but must not remove it.
+        metrics_path[0] = '\0';
+        ctx->tail_exec = 0;
+        ctx->subshell = 1;
+        run_list(words, begin, end, path);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ctx->last_status);
+    } else if (pid == -1) {
+        perror("fork");
+        ctx->last_status = 1;
+        return;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    ctx->last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+//
+// True if every command in a list is a builtin that can run in a subshell
+// without forking: no external programs, pipes, redirections, aliases, or
+// builtins like exit, exec, coproc and stats reset whose effects can't be
+// undone. A find counts only if the builtin find would handle it.
+//
+int builtin_only(char **words, int begin, int end) {
+    static char *safe[] = {"cd", "pwd", "set", "[[", "read", "history", NULL};
+    int width;
+    int command_position = 1;
+    for (int i = begin; i < end; i++) {
+        char *word = words[i];
+        if (list_connector(words, i, &width) != -1) {
+            i += width - 1;
+            command_position = 1;
+            continue;
+        }
+        if (strcmp(word, "|") == 0 || strcmp(word, "<") == 0 || strcmp(word, ">") == 0 ||
+                strcmp(word, "!") == 0) {
+            return 0;
+        }
+        if (strcmp(word, "[[") == 0 && command_position) {
+            while (i + 1 < end && strcmp(words[i + 1], "]]") != 0) {
+                i++;
+            }
+            command_position = 0;
+            continue;
+        }
+        if (!command_position || strcmp(word, "(") == 0 || strcmp(word, "{") == 0 ||
+                strcmp(word, ")") == 0 || strcmp(word, "}") == 0) {
+            continue;
+        }
+        command_position = 0;
+        if (alias_lookup(word) != NULL) {
+            return 0;
+        }
+        if (strcmp(word, "find") == 0) {
+            // Expansions could turn it into one for the external find.
+            int command_end = i;
+            while (command_end < end && list_connector(words, command_end, &width) == -1 &&
+                    strcmp(words[command_end], ")") != 0 && strcmp(words[command_end], "}") != 0) {
+                if (strchr(words[command_end], '$') != NULL) {
+                    return 0;
+                }
+                command_end++;
+            }
+            char **find_words = malloc(sizeof (char *) * (command_end - i + 1));
+            memcpy(find_words, words + i, sizeof (char *) * (command_end - i));
+            find_words[command_end - i] = NULL;
+            int supported = find_supported(find_words);
+            free(find_words);
+            if (!supported) {
+                return 0;
+            }
+            continue;
+        }
+        int known = is_assignment(word);
+        for (int s = 0; safe[s] != NULL && !known; s++) {
+            known = strcmp(word, safe[s]) == 0;
+        }
+        if (!known) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Locks taken around fork, so a prefetch thread can't leave one held in the child.
+void subshell_register(void) {
+    pthread_atfork(subshell_fork_prepare, subshell_fork_parent, subshell_fork_child);
+}
+
+void subshell_fork_prepare(void) {
+    pthread_mutex_lock(&prefetch_lock);
+    pthread_mutex_lock(&path_index_lock);
+    pthread_mutex_lock(&metrics_lock);
+}
+
+void subshell_fork_parent(void) {
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_mutex_unlock(&path_index_lock);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// The prefetch thread isn't copied into the child, it starts its own.
+void subshell_fork_child(void) {
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_mutex_unlock(&path_index_lock);
+    prefetch_started = 0;
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Every command execute_command runs itself, anything else is spawned.
+static char *builtin_names[] = {"history", "!", "[[", "alias", "unalias", "exit", "cd", "pwd",
+        "pushd", "popd", "exec", "coproc", "read", "remote", "find", "set", "stats", "source", NULL};
+
+// Checks if a name is one of builtin_names.
+int is_builtin(char *name) {
+    for (int i = 0; builtin_names[i] != NULL; i++) {
+        if (strcmp(name, builtin_names[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Execute a command, and wait until it finishes.
+//
+//  * `words': a NULL-terminated array of words from the input command line
+//  * `path': a NULL-terminated array of directories to search in;
+//  * `environment': a NULL-terminated array of environment variables.
+//
+static void execute_command(char **words, char **path, char **environment) {
+    assert(words != NULL);
+    assert(path != NULL);
+    assert(environment != NULL);
+    struct glob_pool globbed = {0};
+    int is_redirect = 0;
+
+    if (words [0] == NULL) {
+        // nothing to do
+        return;
+    }
+
+    char *program = NULL;
+
+    // Checking if redirection so not to run builtin command.
+    if (strrchr(words[0], '<') == NULL) {
+        program = words[0];
+    } else if (words_length(words) > 2) {
+        program = words[2];
+        is_redirect = 1;
+    } 
+    if (words_length(words) > 2) {
+        if (strcmp(words[words_length(words) - 2], ">" ) == 0) {
+            is_redirect = 1;
+        }
+    }
+    if (num_pipes(words)) {
+        is_redirect = 1;
+    }
+
+
+    // History commands first so they don't include current command in output.
+    if (strcmp(program, "history") == 0) {
+        if (is_redirect) {no_redirect (program); store_command(words);}
+        else {print_history(words); store_command(words);}
+        return;
+    } else if (strcmp(program, "!") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else {run_history(history_resolve(words), path, environment);}
+        return;
+    } else if (words[0][0] == '^') {
+        run_history(history_substitute(words), path, environment);
+        return;
+    }
+
+    // Now store the current command.
+    store_command(words);
+
+    metrics_add(JSH_COMMANDS, 1);
+    coproc_reap();
+
+    // Expand parameters, the results are released once the command is done.
+    struct arena_mark mark;
+    arena_mark(&mark);
+    int *word_flags;
+    char **expanded_words = expand_words(words, &word_flags);
+    words = expanded_words;
+    if (words[0] == NULL) {
+        free(expanded_words);
+        arena_release(&mark);
+        return;
+    }
+    if (strrchr(words[0], '<') == NULL) {
+        program = words[0];
+    } else if (words_length(words) > 2) {
+        program = words[2];
+    }
+
+    // These builtins take their words literally so patterns are not globbed.
+    if (strcmp(words[0], "[[") == 0 || strcmp(program, "alias") == 0 ||
+            strcmp(program, "unalias") == 0) {
+        if (words[0][0] == '[') {conditional(words);}
+        else if (is_redirect) {no_redirect (program);}
+        else if (strcmp(program, "alias") == 0) {alias(words);}
+        else {unalias(words);}
+        free(expanded_words);
+        arena_release(&mark);
+        return;
+    }
+
+    // find takes its patterns literally, there is no quoting to protect them.
+    // Start paths and other arguments are still globbed.
+    if (strcmp(program, "find") == 0) {
+        for (int i = 1; words[i] != NULL; i++) {
+            if (strcmp(words[i - 1], "-name") == 0 || strcmp(words[i - 1], "-iname") == 0 ||
+                    strcmp(words[i - 1], "-path") == 0 || strcmp(words[i - 1], "-ipath") == 0) {
+                word_flags[i] &= ~WORD_WILDCARD;
+            }
+        }
+    }
+
+    // Expand out anything that needs globbing.
+    words = glob_words(words, word_flags, &globbed);
+
+    // Other built-in commands, a name missing from builtin_names is spawned.
+    if (!is_builtin(program)) {
+        if (is_assignment(program) && words[1] == NULL) {
+            if (is_redirect) {no_redirect (program);}
+            else { do_assignment(words); }
+        } else {
+            execute_external(words, environment, path);
+        }
+    } else if (strcmp(program, "exit") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { do_exit(words); }
+    } else if (strcmp(program, "cd") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { cd(words); }
+    } else if (strcmp(program, "pwd") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { pwd(words); }
+    } else if (strcmp(program, "pushd") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { pushd(words); }
+    } else if (strcmp(program, "popd") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { popd(words); }
+    } else if (strcmp(program, "exec") == 0) {
+        do_exec(words, path, environment);
+    } else if (strcmp(program, "coproc") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { coproc(words, path, environment); }
+    } else if (strcmp(program, "read") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { read_line(words); }
+    } else if (strcmp(program, "remote") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { remote(words); }
+    } else if (strcmp(program, "find") == 0 && !is_redirect && find_supported(words)) {
+        // Redirected or piped finds, and ones using more than the builtin
+        // knows, are left to the external find.
+        find(words);
+    } else if (strcmp(program, "set") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { set_option(words); }
+    } else if (strcmp(program, "stats") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { stats(words); }
+    } else if (strcmp(program, "source") == 0) {
+        if (is_redirect) {no_redirect (program);}
+        else { source(words, path); }
+    } else {
+        // Builtins that pass, like a find the builtin can't handle, run the program instead.
+        execute_external(words, environment, path);
+    }
+
+    // Need to free globbed strings.
+    glob_pool_free(&globbed);
+    free(expanded_words);
+    arena_release(&mark);
+}
+
+//
+// Executes external programs with or without pipes.
+// This also does checking if programs are invalid.
+// Will print error message for invalid pipes.
+//
+void execute_external(char **words, char **environment, char **path) {
+    if (!valid_pipe(words)) {
+        fprintf(stderr, "invalid pipe\n");
+        return; 
+    }
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // With set -o pipemeter, stages that are just pv are taken out and their pipes metered.
+    int *metered = calloc(num_pipes(words) + 1, sizeof (int));
+    int meters = ctx->pipemeter ? strip_meters(words, metered) : 0;
+
+    // With JSH_LOG_OUTPUT set, stdout and stderr go through the logger.
+    struct output_log *output_log = output_log_start(words);
+
+    // Create in and out pipes for file i/o in case we need them.
+    int pipe_file_in[2] = {-1, -1};
+    int pipe_file_out[2] = {-1, -1};
+    int input_redirected = 0;
+    int output_redirect = NONE;
+    char **output_words = NULL;
+
+    // Need to store the in file if there is input redirection.
+    char in_file[MAX_LINE_CHARS];
+
+    // Initialize an array for all the pipes between processes.
+    int *pipe_array = NULL;
+    int pipe_num = num_pipes(words);
+    if (pipe_num) {
+        pipe_array = malloc(sizeof(int) * 2 * pipe_num);
+        for (int i = 0; i < pipe_num; i++) {
+            pipe2(&pipe_array[i * 2], O_CLOEXEC);
+        }
+    }
+
+    // A metered pipe is split in two, the reading stage gets the second one.
+    struct pipe_meter *pipe_meters = meters ? calloc(pipe_num, sizeof (struct pipe_meter)) : NULL;
+    for (int i = 0; meters && i < pipe_num; i++) {
+        int meter_pipe[2];
+        if (!metered[i] || pipe2(meter_pipe, O_CLOEXEC) == -1) {
+            metered[i] = 0;
+            continue;
+        }
+        pipe_meters[i].in = pipe_array[i * 2];
+        pipe_meters[i].out = meter_pipe[1];
+        pipe_array[i * 2] = meter_pipe[0];
+        if (pthread_create(&pipe_meters[i].thread, NULL, meter_thread, &pipe_meters[i]) != 0) {
+            perror("pthread_create");
+            close(pipe_meters[i].in);
+            close(pipe_meters[i].out);
+            metered[i] = 0;
+        }
+    }
+
+    // Keep each stage's words and pid so they can all be waited for and reported.
+    char ***stage_words = malloc(sizeof (char **) * (pipe_num + 1));
+    pid_t *pids = malloc(sizeof (pid_t) * (pipe_num + 1));
+    struct timespec *spawn_times = malloc(sizeof (struct timespec) * (pipe_num + 1));
+    int stages = 0;
+    int keep_read_ends = profile_pipeline && pipe_num > 0;
+    long bytes_in = 0;
+    long bytes_out = 0;
+
+    // Split words array by the pipes.
+    words = split_words(words);
 
     // Loop through every program and create necessary pipes.
     char full_path[MAX_LINE_CHARS];
@@ -272,12 +1633,12 @@ void execute_external(char **words, char **environment, char **path) {
         // If first command check if needs input from file.
         if (pipe_count == 0) {
             // Create input pipe to take from file.
-            pipe(pipe_file_in);
+            pipe2(pipe_file_in, O_CLOEXEC);
             words = setup_redirect_input(words, &redirect_in, pipe_file_in, &actions, in_file);
 
         // If last command check if needs to redirect ouput to file.
         } if (pipe_count == pipe_num) {
-            pipe(pipe_file_out);
+            pipe2(pipe_file_out, O_CLOEXEC);
             setup_redirect_output(words, &redirect_out, pipe_file_out, &actions);
         }
 
@@ -295,7 +1656,8 @@ void execute_external(char **words, char **environment, char **path) {
         // Now look for program location.
         if ((strrchr(words[0], '/') == NULL)) {
             if (!get_full_path(words[0], path, full_path)) {
-                return;
+                posix_spawn_file_actions_destroy(&actions);
+                break;
             }
         } else {
             strcpy(full_path, words[0]);
@@ -305,22 +1667,74 @@ void execute_external(char **words, char **environment, char **path) {
         // If so we can execute it and wait until it is done.
         if (!is_executable(full_path)) {
             fprintf(stderr, "%s: command not found\n", full_path);
-            return;
+            posix_spawn_file_actions_destroy(&actions);
+            break;
+        }
+
+        // Embedded callers can give commands their own stdin, stdout and stderr.
+        if (pipe_count == 0 && !redirect_in && ctx->fds[0] != -1) {
+            posix_spawn_file_actions_adddup2(&actions, ctx->fds[0], 0);
+        }
+        if (pipe_count == pipe_num && redirect_out == NONE && output_log != NULL) {
+            posix_spawn_file_actions_adddup2(&actions, output_log->pipes[0][1], 1);
+        } else if (pipe_count == pipe_num && redirect_out == NONE && ctx->fds[1] != -1) {
+            posix_spawn_file_actions_adddup2(&actions, ctx->fds[1], 1);
+        }
+        if (output_log != NULL) {
+            posix_spawn_file_actions_adddup2(&actions, output_log->pipes[1][1], 2);
+        } else if (ctx->fds[2] != -1) {
+            posix_spawn_file_actions_adddup2(&actions, ctx->fds[2], 2);
+        }
+
+        // The last command of a script replaces the shell instead of being waited for.
+        // Logged output, and a command store_command is waiting to put in the
+        // history log, need the shell to stay, so then it is run like any other.
+        if (ctx->tail_exec && pipe_num == 0 && !redirect_in && redirect_out == NONE && output_log == NULL &&
+                ctx->logged_command == NULL) {
+            close(pipe_file_in[0]);
+            close(pipe_file_in[1]);
+            close(pipe_file_out[0]);
+            close(pipe_file_out[1]);
+            pipe_file_in[0] = pipe_file_in[1] = pipe_file_out[0] = pipe_file_out[1] = -1;
+            fflush(stdout);
+            event_start(&words, NULL, 1);
+            event_flush();
+            metrics_close();
+            execve(full_path, words, environment);
+            perror(full_path);
         }
 
-        // Execute program.
-        posix_spawn(&child, full_path, &actions, NULL, words, environment);
+        // Execute program, posix_spawn returns once the child has exec'd.
+        clock_gettime(CLOCK_MONOTONIC, &spawn_times[stages]);
+        if (pipe_count == 0) {
+            stats_record(words[0], STATS_INPUT, time_since(&ctx->line_time) - time_since(&spawn_times[stages]));
+        }
+        metrics_add(JSH_SPAWNS, 1);
+        if (posix_spawn(&child, full_path, &actions, NULL, words, environment) != 0) {
+            perror(full_path);
+            metrics_add(JSH_SPAWN_FAILURES, 1);
+            posix_spawn_file_actions_destroy(&actions);
+            break;
+        }
+        metrics_add(JSH_JOBS, 1);
+        stats_record(words[0], STATS_SPAWN, time_since(&spawn_times[stages]));
+        posix_spawn_file_actions_destroy(&actions);
+        stage_words[stages] = words;
+        pids[stages] = child;
+        stages++;
 
-        // Handle all the file i/0.
+        // The file i/o is done once every stage has started.
         if (redirect_in) {
-            redirect_input(words, pipe_file_in, in_file);
+            input_redirected = 1;
         }
         if (redirect_out == STORE || redirect_out == APPEND) {
-            redirect_output(words, pipe_file_out, redirect_out);
+            output_redirect = redirect_out;
+            output_words = words;
         }
 
         // If not first command need to close write end of input pipe.
-        if (pipe_count) {
+        // When profiling the shell keeps it to see how full the pipe gets.
+        if (pipe_count && !keep_read_ends) {
             close(pipe_array[(pipe_count - 1) * 2]);
         }
 
@@ -337,47 +1751,377 @@ void execute_external(char **words, char **environment, char **path) {
         pipe_count++;
     }
 
-    // Wait for last program to finish.
-    int exit_status;
-    if (waitpid(child, &exit_status, 0) == -1) {
-        perror("waitpid");
-        free(pipe_array);
-        return;
+    // A stage that failed to start leaves the pipes after it open.
+    for (int i = pipe_count; i < pipe_num; i++) {
+        close(pipe_array[i * 2]);
+        close(pipe_array[i * 2 + 1]);
+    }
+    if (pipe_count > 0 && pipe_count <= pipe_num) {
+        close(pipe_array[(pipe_count - 1) * 2]);
+    }
+    if (keep_read_ends && stages != pipe_num + 1) {
+        for (int i = 0; i < pipe_count - 1; i++) {
+            close(pipe_array[i * 2]);
+        }
+        keep_read_ends = 0;
     }
 
-    free(pipe_array);
-    printf("%s exit status = %d\n", full_path, WEXITSTATUS(exit_status));
-    return;
-}
+    // Only the children hold the logger's pipes now, it sees end of file as they exit.
+    if (output_log != NULL) {
+        close(output_log->pipes[0][1]);
+        close(output_log->pipes[1][1]);
+    }
 
-// Handles redirection from input file into stdin of command.
-void redirect_input(char **words, int *pipe_file_descriptors_in, char *in_file) {
-    close(pipe_file_descriptors_in[0]);
+    if (stages > 0) {
+        event_start(stage_words, pids, stages);
+    }
 
-    FILE *pipe_in = fdopen(pipe_file_descriptors_in[1], "w");
-    if (pipe_in == NULL) {
-      perror("fdopen");
+    // Handle all the file i/o, the redirect functions close the pipes they use.
+    struct redirect_copy input_copy = {stage_words[0], {pipe_file_in[0], pipe_file_in[1]}, in_file, NONE, 0, 0};
+    struct redirect_copy output_copy = {output_words, {pipe_file_out[0], pipe_file_out[1]}, NULL, output_redirect, 0, 0};
+    int input_threaded = 0;
+    int output_threaded = 0;
+    if (input_redirected) {
+        input_threaded = pthread_create(&input_copy.thread, NULL, redirect_input_thread, &input_copy) == 0;
+        if (!input_threaded) {
+            bytes_in = redirect_input(stage_words[0], pipe_file_in, in_file);
+        }
+        pipe_file_in[0] = pipe_file_in[1] = -1;
     }
-    FILE *f_in = fopen(in_file, "r");
-    if (f_in == NULL) {
-        perror("fopen");
+    if (output_redirect != NONE) {
+        output_threaded = pthread_create(&output_copy.thread, NULL, redirect_output_thread, &output_copy) == 0;
+        if (!output_threaded) {
+            bytes_out = redirect_output(output_words, pipe_file_out, output_redirect);
+        }
+        pipe_file_out[0] = pipe_file_out[1] = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pipe_file_in[i] != -1) {
+            close(pipe_file_in[i]);
+        }
+        if (pipe_file_out[i] != -1) {
+            close(pipe_file_out[i]);
+        }
     }
 
-    char file_path[MAX_LINE_CHARS];
-    char line[MAX_LINE_CHARS];
+    if (keep_read_ends) {
+        profile_wait(stage_words, pids, stages, pipe_array);
+    }
 
-    snprintf(file_path, MAX_LINE_CHARS, "./%s", words[1]);
+    // The copies end once the stages have closed their ends of the pipes.
+    if (input_threaded) {
+        pthread_join(input_copy.thread, NULL);
+        bytes_in = input_copy.bytes;
+    }
+    if (output_threaded) {
+        pthread_join(output_copy.thread, NULL);
+        bytes_out = output_copy.bytes;
+    }
 
-    while (fgets(line, MAX_LINE_CHARS, f_in)) {
-      fputs(line, pipe_in); 
+    // Wait for every program, the last one gives the exit status.
+    int *statuses = malloc(sizeof (int) * (stages + 1));
+    struct rusage *usages = malloc(sizeof (struct rusage) * (stages + 1));
+    struct timespec *exit_times = malloc(sizeof (struct timespec) * (stages + 1));
+    int waited = wait_stages(pids, stages, statuses, usages, exit_times);
+    for (int i = 0; i < stages; i++) {
+        stats_record(stage_words[i][0], STATS_WALL, (exit_times[i].tv_sec - spawn_times[i].tv_sec) +
+                (exit_times[i].tv_nsec - spawn_times[i].tv_nsec) / 1e9);
+        metrics_add(JSH_JOBS, -1);
     }
 
-    fclose(f_in);
-    fclose(pipe_in);
-}
+    for (int i = 0; meters && i < pipe_num; i++) {
+        if (metered[i]) {
+            pthread_join(pipe_meters[i].thread, NULL);
+            if (i + 1 < stages) {
+                meter_report(&pipe_meters[i], stage_words[i][0], stage_words[i + 1][0]);
+            }
+        }
+    }
 
-// Handles redirection of stdout of command into file.
-void redirect_output(char **words, int *pipe_file_descriptors_out, int redirect) {
+    if (stages > 0) {
+        event_end(pids, statuses, usages, stages, time_since(&start_time), bytes_in, bytes_out);
+    }
+    if (stages == pipe_num + 1 && waited) {
+        ctx->last_status = WEXITSTATUS(statuses[stages - 1]);
+        if (!ctx->embedded) {
+            printf("%s exit status = %d\n", full_path, ctx->last_status);
+        }
+    } else if (stages != pipe_num + 1) {
+        ctx->last_status = 127;
+    }
+    if (output_log != NULL) {
+        output_log_finish(output_log, ctx->last_status);
+    }
+
+    free(statuses);
+    free(usages);
+    free(exit_times);
+    free(pipe_meters);
+    free(metered);
+    free(stage_words);
+    free(spawn_times);
+    free(pids);
+    free(pipe_array);
+    return;
+}
+
+//
+// Starts logging a command's output if JSH_LOG_OUTPUT names a file.
+// The log gets a start line with the time and command, then each piece of
+// output headed by which stream and how many bytes it is, and an end line
+// with the exit status. Returns NULL when not logging.
+//
+struct output_log *output_log_start(char **words) {
+    char *log_path = getenv("JSH_LOG_OUTPUT");
+    if (log_path == NULL || *log_path == '\0') {
+        return NULL;
+    }
+
+    // Not O_APPEND, splice can't write to files opened for appending.
+    // Every frame is written under output_log_lock instead.
+    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (log_fd == -1) {
+        perror(log_path);
+        return NULL;
+    }
+
+    struct output_log *log = malloc(sizeof *log);
+    log->log_fd = log_fd;
+    int opened = 0;
+    for (; opened < 3; opened++) {
+        int *fds = (opened < 2) ? log->pipes[opened] : log->stop_pipe;
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            break;
+        }
+    }
+    if (opened < 3) {
+        perror("pipe");
+        for (int i = 0; i < opened; i++) {
+            int *fds = (i < 2) ? log->pipes[i] : log->stop_pipe;
+            close(fds[0]);
+            close(fds[1]);
+        }
+        close(log_fd);
+        free(log);
+        return NULL;
+    }
+
+    // The thread must never block on a read, background children can hold the pipes open.
+    fcntl(log->pipes[0][0], F_SETFL, O_NONBLOCK);
+    fcntl(log->pipes[1][0], F_SETFL, O_NONBLOCK);
+    log->targets[0] = (ctx->fds[1] != -1) ? ctx->fds[1] : 1;
+    log->targets[1] = (ctx->fds[2] != -1) ? ctx->fds[2] : 2;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char *command = join_words(words);
+    output_log_lock(log_fd);
+    dprintf(log_fd, "=== start %lld.%03ld %s\n", (long long)now.tv_sec, now.tv_nsec / 1000000, command);
+    flock(log_fd, LOCK_UN);
+    free(command);
+
+    fflush(stdout);
+    if (pthread_create(&log->thread, NULL, output_log_thread, log) != 0) {
+        perror("pthread_create");
+        for (int i = 0; i < 2; i++) {
+            close(log->pipes[i][0]);
+            close(log->pipes[i][1]);
+        }
+        close(log->stop_pipe[0]);
+        close(log->stop_pipe[1]);
+        close(log_fd);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+//
+// Called once the command's stages are reaped. Tells the logger to move
+// what is already waiting and stop, so a background child still holding the
+// pipes doesn't keep the shell waiting, then writes the end line.
+//
+void output_log_finish(struct output_log *log, int status) {
+    write_all(log->stop_pipe[1], "", 1);
+    pthread_join(log->thread, NULL);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    output_log_lock(log->log_fd);
+    dprintf(log->log_fd, "=== end %lld.%03ld status %d\n", (long long)now.tv_sec, now.tv_nsec / 1000000, status);
+    flock(log->log_fd, LOCK_UN);
+    close(log->pipes[0][0]);
+    close(log->pipes[1][0]);
+    close(log->stop_pipe[0]);
+    close(log->stop_pipe[1]);
+    close(log->log_fd);
+    free(log);
+}
+
+//
+// Copies output to its target and the log until the command has closed both
+// streams or output_log_finish asks it to stop. tee() duplicates what is in the command's pipe into a second pipe
+// without consuming it, the second pipe is spliced into the log and the
+// first into the target, so the data is never copied into the shell.
+//
+void *output_log_thread(void *arg) {
+    struct output_log *log = arg;
+    int copy_pipe[2];
+    if (pipe2(copy_pipe, O_CLOEXEC) == -1) {
+        copy_pipe[0] = copy_pipe[1] = -1;
+    }
+
+    struct pollfd polls[3] = {{log->pipes[0][0], POLLIN, 0}, {log->pipes[1][0], POLLIN, 0},
+        {log->stop_pipe[0], POLLIN, 0}};
+    int drain_rounds = -1;
+    while ((polls[0].fd != -1 || polls[1].fd != -1) && drain_rounds != 0) {
+        // Once stopping, only what is already in the pipes is moved.
+        int ready = poll(polls, 3, (drain_rounds == -1) ? -1 : 0);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (ready == 0) {
+            break;
+        }
+        if (drain_rounds > 0) {
+            drain_rounds--;
+        }
+        if (polls[2].revents) {
+            polls[2].fd = -1;
+            drain_rounds = OUTPUT_LOG_DRAIN_ROUNDS;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (polls[i].fd != -1 && polls[i].revents && !output_log_move(log, i, copy_pipe)) {
+                polls[i].fd = -1;
+            }
+        }
+    }
+
+    if (copy_pipe[0] != -1) {
+        close(copy_pipe[0]);
+        close(copy_pipe[1]);
+    }
+    return NULL;
+}
+
+// Moves what is waiting on one stream, returns 0 once the stream has ended.
+int output_log_move(struct output_log *log, int stream, int copy_pipe[2]) {
+    int from = log->pipes[stream][0];
+    char *name = (stream == 0) ? "stdout" : "stderr";
+    char buffer[OUTPUT_LOG_CHUNK];
+
+    ssize_t n = (copy_pipe[0] != -1) ? tee(from, copy_pipe[1], OUTPUT_LOG_CHUNK, SPLICE_F_NONBLOCK) : -1;
+    if (n == 0) {
+        return 0;
+    } else if (n == -1 && errno == EAGAIN) {
+        return 1;
+    } else if (n == -1) {
+        // Without tee the output is read once and written to both.
+        n = read(from, buffer, sizeof buffer);
+        if (n <= 0) {
+            return n == -1 && (errno == EINTR || errno == EAGAIN);
+        }
+        output_log_lock(log->log_fd);
+        dprintf(log->log_fd, "--- %s %zd\n", name, n);
+        write_all(log->log_fd, buffer, n);
+        flock(log->log_fd, LOCK_UN);
+        write_all(log->targets[stream], buffer, n);
+        return 1;
+    }
+
+    output_log_lock(log->log_fd);
+    dprintf(log->log_fd, "--- %s %zd\n", name, n);
+    for (ssize_t moved = 0; moved < n;) {
+        ssize_t m = splice(copy_pipe[0], NULL, log->log_fd, NULL, n - moved, SPLICE_F_MOVE);
+        if (m <= 0) {
+            // Keep the copy pipe empty for the next tee even if the log can't be written.
+            m = read(copy_pipe[0], buffer, (n - moved) < (ssize_t)sizeof buffer ? (size_t)(n - moved) : sizeof buffer);
+            if (m <= 0) {
+                break;
+            }
+            write_all(log->log_fd, buffer, m);
+        }
+        moved += m;
+    }
+    flock(log->log_fd, LOCK_UN);
+
+    // Terminals can't be spliced to, what they get is read and written instead.
+    for (ssize_t moved = 0; moved < n;) {
+        ssize_t m = splice(from, NULL, log->targets[stream], NULL, n - moved, SPLICE_F_MOVE);
+        if (m <= 0) {
+            m = read(from, buffer, (n - moved) < (ssize_t)sizeof buffer ? (size_t)(n - moved) : sizeof buffer);
+            if (m <= 0) {
+                break;
+            }
+            write_all(log->targets[stream], buffer, m);
+        }
+        moved += m;
+    }
+    return 1;
+}
+
+//
+// Takes the log's lock for one frame and moves to its end, another shell
+// may have written there since. Other shells sharing the log wait for the
+// frame to finish before writing theirs.
+//
+void output_log_lock(int log_fd) {
+    while (flock(log_fd, LOCK_EX) == -1 && errno == EINTR) {
+    }
+    lseek(log_fd, 0, SEEK_END);
+}
+
+// Handles redirection from input file into stdin of command.
+// Returns the number of bytes copied.
+long redirect_input(char **words, int *pipe_file_descriptors_in, char *in_file) {
+    close(pipe_file_descriptors_in[0]);
+
+    FILE *pipe_in = fdopen(pipe_file_descriptors_in[1], "w");
+    if (pipe_in == NULL) {
+      perror("fdopen");
+    }
+    int in_fd = openat(cwd_dir(), in_file, O_RDONLY | O_CLOEXEC);
+    FILE *f_in = (in_fd == -1) ? NULL : fdopen(in_fd, "r");
+    if (f_in == NULL) {
+        perror("fopen");
+    }
+
+    char line[MAX_LINE_CHARS];
+
+    long bytes = 0;
+    while (fgets(line, MAX_LINE_CHARS, f_in)) {
+      fputs(line, pipe_in); 
+      bytes += strlen(line);
+    }
+
+    fclose(f_in);
+    fclose(pipe_in);
+    return bytes;
+}
+
+// Copies a < file on its own thread. A command that stops reading early gives EPIPE, not SIGPIPE.
+void *redirect_input_thread(void *arg) {
+    struct redirect_copy *copy = arg;
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+    copy->bytes = redirect_input(copy->words, copy->pipe_fds, copy->file);
+    return NULL;
+}
+
+// Copies a command's output into a > or >> file on its own thread.
+void *redirect_output_thread(void *arg) {
+    struct redirect_copy *copy = arg;
+    copy->bytes = redirect_output(copy->words, copy->pipe_fds, copy->redirect);
+    return NULL;
+}
+
+// Handles redirection of stdout of command into file.
+// Returns the number of bytes copied.
+long redirect_output(char **words, int *pipe_file_descriptors_out, int redirect) {
     int length = words_length(words);
     if (redirect == APPEND) {
         length++;
@@ -388,31 +2132,29 @@ void redirect_output(char **words, int *pipe_file_descriptors_out, int redirect)
     FILE *pipe_p = fdopen(pipe_file_descriptors_out[0], "r");
     FILE *fp;
 
-    // Get filepath.
-    char file_path[MAX_LINE_CHARS];
-    snprintf(file_path, MAX_LINE_CHARS, "./%s", words[length + 1]);
-
-    // Open file with correct mode.
-    if (redirect == STORE) {
-        fp = fopen(file_path, "w");
-    } else {
-        fp = fopen(file_path, "a");
-    }
+    // Open file with correct mode, relative to the current directory.
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | ((redirect == STORE) ? O_TRUNC : O_APPEND);
+    int file_fd = openat(cwd_dir(), words[length + 1], flags, 0666);
+    fp = (file_fd == -1) ? NULL : fdopen(file_fd, (redirect == STORE) ? "w" : "a");
 
     if (fp == NULL) {
         perror("fopen");
-        return;
+        fclose(pipe_p);
+        return 0;
     }
 
     // Read from file and write into file with whichever mode is selected..
     char line[MAX_LINE_CHARS];
+    long bytes = 0;
     while (fgets(line, MAX_LINE_CHARS, pipe_p) != NULL) {
         fputs(line, fp);
+        bytes += strlen(line);
     }
 
     // Close up pipe and file.
     fclose(pipe_p);
     fclose(fp);
+    return bytes;
 }
 
 //
@@ -424,6 +2166,16 @@ void redirect_output(char **words, int *pipe_file_descriptors_out, int redirect)
 void setup_redirect_output (char **words, int *redirect, int *pipe_file_descriptors, posix_spawn_file_actions_t *actions) {
     // Redirect output with no append.
     int length = words_length(words);
+
+    // Output to an open descriptor, eg. {"echo", "hi", ">", "&3", NULL}.
+    if (length > 2 && strcmp(words[length - 2], ">") == 0 && words[length - 1][0] == '&' &&
+            words[length - 1][1] != '\0' && strspn(words[length - 1] + 1, "0123456789") == strlen(words[length - 1] + 1)) {
+        posix_spawn_file_actions_adddup2(actions, atoi(words[length - 1] + 1), 1);
+        *redirect = DUPLICATE;
+        words[length - 2] = NULL;
+        return;
+    }
+
     if (length > 2 && strcmp(words[length - 2], ">" ) == 0) {
         posix_spawn_file_actions_addclose(actions, pipe_file_descriptors[0]);
         posix_spawn_file_actions_adddup2(actions, pipe_file_descriptors[1], 1);
@@ -469,212 +2221,4645 @@ char **setup_redirect_input (char **words, int *redirect_in, int *pipe_file_desc
 // Counts how many "|" characters there are in words.
 int num_pipes(char **words) {
     int num = 0;
-    for (int i = 0; i < words_length(words); i++) {
+    for (int i = 0; words[i] != NULL; i++) {
         if (strcmp(words[i], "|") == 0) {
             num++;
         }
     }
-    return num;
+    return num;
+}
+
+//
+// Splits the words array with NULL where the pipes are.
+// eg. {"seq", "2", "20", "|", "grep", "2", NULL} becomes {"seq", "2", "20", NULL, "grep", "2", NULL}
+//
+char **split_words(char **words) {
+    int length = words_length(words);
+    for (int i = 0; i < length; i++) {
+        if (strcmp(words[i], "|") == 0) {
+            words[i] = NULL;
+        }
+    }
+    return words;
+}
+
+// Returns a pointer to the start of arguments for next pipe.
+char **next_pipe(char **words) {
+    char **start = words;
+    int i = 0;
+    while (1) {
+        if (words[i] == NULL) {
+            start = &words[i + 1];
+            return start;
+        }
+        i++;
+    }
+}
+
+// built-in commands implementations.
+void pwd(char **words) {
+    char pathname[MAX_LINE_CHARS];
+    if (getcwd(pathname, MAX_LINE_CHARS) == NULL) {
+        perror("getcwd");
+        return;
+    }
+    printf("current directory is '%s'\n", pathname);
+    return;
+}
+
+// Changes directory to specified argument.
+void cd(char **words) {
+    ctx->last_status = 0;
+    char *directory = (words[1] == NULL) ? getenv("HOME") : words[1];
+    if (directory == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        ctx->last_status = 1;
+        return;
+    }
+    int fd = cwd_open(directory);
+    if (fd != -1 && cwd_change(fd)) {
+        return;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    fprintf(stderr, "cd: %s: No such file or directory\n", directory);
+    ctx->last_status = 1;
+    return;
+}
+
+// Changes to the directory given and pushes the old one, or with no
+// argument swaps the current directory with the top of the stack.
+void pushd(char **words) {
+    ctx->last_status = 1;
+    if (words[1] != NULL && words[2] != NULL) {
+        fprintf(stderr, "pushd: too many arguments\n");
+        ctx->last_status = 2;
+        return;
+    }
+    int old_fd = cwd_dir();
+    if (old_fd == AT_FDCWD) {
+        perror("pushd");
+        return;
+    }
+
+    int fd;
+    if (words[1] == NULL) {
+        if (dir_stack_count == 0) {
+            fprintf(stderr, "pushd: no other directory\n");
+            return;
+        }
+        fd = dir_stack[dir_stack_count - 1];
+        if (fchdir(fd) == -1) {
+            perror("pushd");
+            return;
+        }
+        dir_stack[dir_stack_count - 1] = old_fd;
+    } else {
+        fd = cwd_open(words[1]);
+        if (fd == -1 || fchdir(fd) == -1) {
+            fprintf(stderr, "pushd: %s: No such file or directory\n", words[1]);
+            if (fd != -1) {
+                close(fd);
+            }
+            return;
+        }
+        if (dir_stack_count == dir_stack_capacity) {
+            dir_stack_capacity = dir_stack_capacity ? dir_stack_capacity * 2 : 8;
+            dir_stack = realloc(dir_stack, sizeof (int) * dir_stack_capacity);
+        }
+        dir_stack[dir_stack_count++] = old_fd;
+    }
+    cwd_fd = fd;
+    ctx->last_status = 0;
+    dirs_print();
+}
+
+// Returns to the directory on top of the stack.
+void popd(char **words) {
+    if (words[1] != NULL) {
+        fprintf(stderr, "popd: too many arguments\n");
+        ctx->last_status = 2;
+        return;
+    }
+    if (dir_stack_count == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        ctx->last_status = 1;
+        return;
+    }
+    int fd = dir_stack[dir_stack_count - 1];
+    if (!cwd_change(fd)) {
+        perror("popd");
+        ctx->last_status = 1;
+        return;
+    }
+    dir_stack_count--;
+    ctx->last_status = 0;
+    dirs_print();
+}
+
+// Prints the current directory then the stack, most recent first.
+void dirs_print(void) {
+    char pathname[PATH_MAX];
+    if (getcwd(pathname, sizeof pathname) != NULL) {
+        printf("%s", pathname);
+    }
+    for (int i = dir_stack_count - 1; i >= 0; i--) {
+        char link[64];
+        snprintf(link, sizeof link, "/proc/self/fd/%d", dir_stack[i]);
+        ssize_t length = readlink(link, pathname, sizeof pathname - 1);
+        pathname[length < 0 ? 0 : length] = '\0';
+        printf(" %s", pathname);
+    }
+    printf("\n");
+}
+
+//
+// Opens the descriptor for the current directory. Called before any thread
+// is started, after that only cd, pushd and popd change it.
+//
+void cwd_init(void) {
+    if (cwd_fd == -1) {
+        cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+}
+
+// Returns the descriptor for the current directory, or AT_FDCWD if it couldn't
+// be opened, which the *at() calls take just the same.
+int cwd_dir(void) {
+    return (cwd_fd == -1) ? AT_FDCWD : cwd_fd;
+}
+
+// Opens a directory relative to the current one, -1 if it can't be.
+int cwd_open(char *directory) {
+    return openat(cwd_dir(), directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Makes fd the current directory, which then owns it. Returns 0 on failure.
+int cwd_change(int fd) {
+    if (fchdir(fd) == -1) {
+        return 0;
+    }
+    if (cwd_fd != -1) {
+        close(cwd_fd);
+    }
+    cwd_fd = fd;
+    return 1;
+}
+
+// Executes each line of the file given as an argument.
+void source(char **words, char **path) {
+    if (words[1] == NULL) {
+        fprintf(stderr, "source: filename argument required\n");
+        ctx->last_status = 2;
+        return;
+    } else if (words[2] != NULL) {
+        fprintf(stderr, "source: too many arguments\n");
+        ctx->last_status = 2;
+        return;
+    }
+    ctx->last_status = source_file(words[1], path) ? 0 : 1;
+}
+
+//
+// Runs every line of a file in the current shell without storing it in history.
+// Returns 0 if the file could not be read.
+//
+int source_file(char *file_path, char **path) {
+    extern char **environ;
+
+    if (ctx->source_depth >= MAX_SOURCE_DEPTH) {
+        fprintf(stderr, "source: %s: too many nested files\n", file_path);
+        return 0;
+    }
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "source: %s: No such file or directory\n", file_path);
+        return 0;
+    }
+
+    // Big files are mapped so they can be tokenized ahead on other threads.
+    struct stat st;
+    char *data = MAP_FAILED;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= PARSE_PARALLEL_MIN) {
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    }
+
+    // Remember the file so a saved image can tell when it changes.
+    if (image_recording) {
+        char *real_path = realpath(file_path, NULL);
+        if (real_path != NULL) {
+            image_sources = realloc(image_sources, sizeof (char *) * (image_source_count + 1));
+            image_sources[image_source_count++] = real_path;
+        }
+    }
+
+    int old_record_history = ctx->record_history;
+    int old_tail_exec = ctx->tail_exec;
+    ctx->record_history = 0;
+    ctx->tail_exec = 0;
+    ctx->source_depth++;
+
+    if (data != MAP_FAILED) {
+        source_parallel(data, st.st_size, path);
+        munmap(data, st.st_size);
+    } else {
+        char line[MAX_LINE_CHARS];
+        while (fgets(line, MAX_LINE_CHARS, fp) != NULL) {
+            run_line(line, path, environ);
+        }
+    }
+
+    ctx->source_depth--;
+    ctx->record_history = old_record_history;
+    ctx->tail_exec = old_tail_exec;
+    fclose(fp);
+    return 1;
+}
+
+//
+// Runs a mapped file a line at a time. Each line is a whole command, so the
+// file is split at newlines into a chunk per CPU. Chunk 0 is run straight
+// away while threads tokenize the others, which are then run in order.
+// The mapping is private and writable so lines can be ended in place.
+//
+void source_parallel(char *data, size_t size, char **path) {
+    extern char **environ;
+    int chunk_count = thread_count(PARSE_MAX_THREADS);
+    struct parse_chunk chunks[PARSE_MAX_THREADS];
+    char *end = data + size;
+    char *begin = data;
+    for (int i = 0; i < chunk_count; i++) {
+        char *split = (i == chunk_count - 1) ? end : data + size * (i + 1) / chunk_count;
+        if (split < begin) {
+            split = begin;
+        }
+        char *newline = (split < end) ? memchr(split, '\n', end - split) : NULL;
+        chunks[i].begin = begin;
+        chunks[i].end = (newline != NULL) ? newline + 1 : end;
+        chunks[i].commands = NULL;
+        chunks[i].count = 0;
+        chunks[i].threaded = 0;
+        begin = chunks[i].end;
+    }
+    for (int i = 1; i < chunk_count; i++) {
+        chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, parse_chunk, &chunks[i]) == 0;
+    }
+
+    // The first chunk needs no tokenizing ahead, its lines run as they are found.
+    for (char *line = chunks[0].begin; line < chunks[0].end;) {
+        char *newline = memchr(line, '\n', chunks[0].end - line);
+        if (newline != NULL) {
+            *newline = '\0';
+            run_line(line, path, environ);
+            line = newline + 1;
+        } else {
+            char *last = strndup(line, chunks[0].end - line);
+            run_line(last, path, environ);
+            free(last);
+            break;
+        }
+    }
+
+    for (int i = 1; i < chunk_count; i++) {
+        if (chunks[i].threaded) {
+            pthread_join(chunks[i].thread, NULL);
+        } else {
+            parse_chunk(&chunks[i]);
+        }
+        for (size_t c = 0; c < chunks[i].count; c++) {
+            clock_gettime(CLOCK_MONOTONIC, &ctx->line_time);
+            run_words(chunks[i].commands[c], path, environ);
+        }
+        free(chunks[i].commands);
+    }
+}
+
+// Tokenizes every line of a chunk, comments and blank lines are dropped.
+void *parse_chunk(void *arg) {
+    struct parse_chunk *chunk = arg;
+    size_t capacity = 0;
+    for (char *line = chunk->begin; line < chunk->end;) {
+        char *newline = memchr(line, '\n', chunk->end - line);
+        char *last = NULL;
+        if (newline != NULL) {
+            *newline = '\0';
+        } else {
+            // The file may not end in a newline, and there may be no room to add one.
+            last = strndup(line, chunk->end - line);
+        }
+        char *text = (last != NULL) ? last : line;
+        char *start = text + strspn(text, WORD_SEPARATORS);
+        if (*start != '\0' && *start != '#') {
+            if (chunk->count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                chunk->commands = realloc(chunk->commands, sizeof (char **) * capacity);
+            }
+            chunk->commands[chunk->count++] = tokenize(text, WORD_SEPARATORS, SPECIAL_CHARS);
+        }
+        free(last);
+        line = (newline != NULL) ? newline + 1 : chunk->end;
+    }
+    return NULL;
+}
+
+//
+// Starts a command with pipes to its stdin and stdout that stay open in the shell.
+// NAME_0 is set to the descriptor to read its output from, NAME_1 to the one
+// that writes to its input and NAME_PID to its pid.
+// eg. coproc BC bc -l, then echo 1/3 > &$BC_1 and read -u $BC_0 x
+//
+void coproc(char **words, char **path, char **environment) {
+    if (words[1] == NULL || words[2] == NULL || !is_assignment_name(words[1])) {
+        fprintf(stderr, "coproc: usage: coproc NAME command [args ...]\n");
+        ctx->last_status = 2;
+        return;
+    }
+
+    char full_path[MAX_LINE_CHARS];
+    if (strchr(words[2], '/') == NULL) {
+        if (!get_full_path(words[2], path, full_path)) {
+            ctx->last_status = 127;
+            return;
+        }
+    } else {
+        snprintf(full_path, MAX_LINE_CHARS, "%s", words[2]);
+    }
+    if (!is_executable(full_path)) {
+        fprintf(stderr, "%s: command not found\n", full_path);
+        ctx->last_status = 127;
+        return;
+    }
+
+    // Both pipes are close-on-exec so no other command inherits them.
+    int to_child[2];
+    int from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) == -1) {
+        perror("pipe");
+        ctx->last_status = 1;
+        return;
+    }
+    if (pipe2(from_child, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(to_child[0]);
+        close(to_child[1]);
+        ctx->last_status = 1;
+        return;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_child[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, from_child[1], 1);
+    pid_t pid;
+    int spawned = posix_spawn(&pid, full_path, &actions, NULL, &words[2], environment) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    close(to_child[0]);
+    close(from_child[1]);
+    if (!spawned) {
+        perror(full_path);
+        close(to_child[1]);
+        close(from_child[0]);
+        ctx->last_status = 126;
+        return;
+    }
+    metrics_add(JSH_SPAWNS, 1);
+    metrics_add(JSH_JOBS, 1);
+
+    struct coproc *new_coproc = malloc(sizeof *new_coproc);
+    new_coproc->name = strdup(words[1]);
+    new_coproc->pid = pid;
+    new_coproc->in = to_child[1];
+    new_coproc->out = from_child[0];
+    new_coproc->next = ctx->coprocs;
+    ctx->coprocs = new_coproc;
+
+    char name[MAX_LINE_CHARS];
+    char value[32];
+    snprintf(name, MAX_LINE_CHARS, "%s_0", words[1]);
+    snprintf(value, sizeof value, "%d", new_coproc->out);
+    setenv(name, value, 1);
+    snprintf(name, MAX_LINE_CHARS, "%s_1", words[1]);
+    snprintf(value, sizeof value, "%d", new_coproc->in);
+    setenv(name, value, 1);
+    snprintf(name, MAX_LINE_CHARS, "%s_PID", words[1]);
+    snprintf(value, sizeof value, "%d", (int)pid);
+    setenv(name, value, 1);
+    ctx->last_status = 0;
+}
+
+// Reaps coprocesses that have exited, closing their pipes and unsetting their variables.
+void coproc_reap(void) {
+    struct coproc **link = &ctx->coprocs;
+    while (*link != NULL) {
+        struct coproc *c = *link;
+        if (waitpid(c->pid, NULL, WNOHANG) != c->pid) {
+            link = &c->next;
+            continue;
+        }
+        metrics_add(JSH_JOBS, -1);
+        close(c->in);
+        close(c->out);
+        char name[MAX_LINE_CHARS];
+        char *suffixes[] = {"_0", "_1", "_PID"};
+        for (int i = 0; i < 3; i++) {
+            snprintf(name, MAX_LINE_CHARS, "%s%s", c->name, suffixes[i]);
+            unsetenv(name);
+        }
+        *link = c->next;
+        free(c->name);
+        free(c);
+    }
+}
+
+//
+// Reads a line from stdin, or the descriptor given with -u, into variables.
+// Each variable gets one word and the last one gets the rest of the line.
+// The line is read a byte at a time so nothing after it is taken from a shared pipe.
+//
+void read_line(char **words) {
+    int fd = 0;
+    int first = 1;
+    if (words[1] != NULL && strcmp(words[1], "-u") == 0) {
+        char *endptr;
+        fd = words[2] != NULL ? (int)strtol(words[2], &endptr, 10) : -1;
+        if (words[2] == NULL || *endptr != '\0' || fd < 0) {
+            fprintf(stderr, "read: -u: invalid file descriptor\n");
+            ctx->last_status = 2;
+            return;
+        }
+        first = 3;
+    }
+    if (words[first] == NULL) {
+        fprintf(stderr, "read: usage: read [-u fd] NAME [NAME ...]\n");
+        ctx->last_status = 2;
+        return;
+    }
+    for (int i = first; words[i] != NULL; i++) {
+        if (!is_assignment_name(words[i])) {
+            fprintf(stderr, "read: %s: not a valid identifier\n", words[i]);
+            ctx->last_status = 2;
+            return;
+        }
+    }
+
+    size_t size = 128;
+    size_t length = 0;
+    char *line = malloc(size);
+    int got_newline = 0;
+    char ch;
+    ssize_t n;
+    while ((n = read(fd, &ch, 1)) == 1 || (n == -1 && errno == EINTR)) {
+        if (n != 1) {
+            continue;
+        }
+        if (ch == '\n') {
+            got_newline = 1;
+            break;
+        }
+        if (length + 1 >= size) {
+            size *= 2;
+            line = realloc(line, size);
+        }
+        line[length++] = ch;
+    }
+    line[length] = '\0';
+    if (n == -1) {
+        perror("read");
+    }
+
+    char *s = line;
+    for (int i = first; words[i] != NULL; i++) {
+        s += strspn(s, " \t");
+        size_t word_length = words[i + 1] == NULL ? strlen(s) : strcspn(s, " \t");
+        char *value = strndup(s, word_length);
+        setenv(words[i], value, 1);
+        forget_home(words[i]);
+        free(value);
+        s += word_length;
+    }
+    free(line);
+
+    // A final line without a newline still counts, only a read of nothing fails.
+    ctx->last_status = (got_newline || length > 0) ? 0 : 1;
+}
+
+//
+// Applies any redirections to the shell itself, then replaces the shell
+// with the command if one is given.
+// eg. {"exec", ">", ">", "log", NULL} appends everything the shell prints to log.
+//
+void do_exec(char **words, char **path, char **environment) {
+    if (ctx->embedded) {
+        fprintf(stderr, "exec: not permitted in an embedded shell\n");
+        ctx->last_status = 2;
+        return;
+    } else if (num_pipes(words)) {
+        fprintf(stderr, "exec: pipes not permitted\n");
+        ctx->last_status = 2;
+        return;
+    }
+
+    // Pull the redirections out of the words, leaving just the command.
+    int length = words_length(words);
+    char **command = malloc(sizeof (char *) * (length + 1));
+    int command_length = 0;
+    for (int i = 1; i < length; i++) {
+        int fd = -1;
+        int flags = 0;
+        char *target = NULL;
+        if (strcmp(words[i], "<") == 0 && i + 1 < length) {
+            fd = 0;
+            flags = O_RDONLY;
+            target = words[++i];
+        } else if (strcmp(words[i], ">") == 0 && i + 2 < length && strcmp(words[i + 1], ">") == 0) {
+            fd = 1;
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            target = words[i + 2];
+            i += 2;
+        } else if (strcmp(words[i], ">") == 0 && i + 1 < length) {
+            fd = 1;
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            target = words[++i];
+        } else {
+            command[command_length++] = words[i];
+            continue;
+        }
+
+        int file = openat(cwd_dir(), target, flags, 0666);
+        if (file == -1) {
+            perror(target);
+            free(command);
+            ctx->last_status = 1;
+            return;
+        }
+        if (fd == 1) {
+            fflush(stdout);
+        }
+        if (dup2(file, fd) == -1) {
+            perror("dup2");
+        }
+        close(file);
+    }
+    command[command_length] = NULL;
+
+    ctx->last_status = 0;
+    if (command_length == 0) {
+        free(command);
+        return;
+    }
+
+    char full_path[MAX_LINE_CHARS];
+    if (strrchr(command[0], '/') == NULL) {
+        if (!get_full_path(command[0], path, full_path)) {
+            free(command);
+            ctx->last_status = 127;
+            return;
+        }
+    } else {
+        snprintf(full_path, MAX_LINE_CHARS, "%s", command[0]);
+    }
+    if (!is_executable(full_path)) {
+        fprintf(stderr, "%s: command not found\n", full_path);
+        free(command);
+        ctx->last_status = 127;
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    metrics_close();
+    execve(full_path, command, environment);
+    perror(full_path);
+    free(command);
+    ctx->last_status = 126;
+}
+
+// Error message if try to redirect built in command.
+void no_redirect (char *program) {
+    fprintf(stderr, "%s: I/O redirection not permitted for builtin commands\n", program);
+}
+
+//
+// Returns path of file if it is in path.
+// If it is not found it will return NULL.
+//
+int get_full_path(char *program, char **path, char full_path[MAX_LINE_CHARS]) {
+    // prefetch_commands may have already found it, and counted the lookup.
+    if (find_resolved(program, full_path)) {
+        return 1;
+    }
+
+    // Then try the shared index, which needs no access() probes.
+    if (path_index_lookup(program, path, full_path)) {
+        metrics_add(JSH_PATH_HITS, 1);
+        return 1;
+    }
+    metrics_add(JSH_PATH_MISSES, 1);
+
+    // Next check if the file is in one of the path directories.
+    int i = 0;
+    while(path[i] != NULL) {
+        snprintf(full_path, MAX_LINE_CHARS, "%s/%s", path[i], program);
+        if (faccessat(cwd_dir(), full_path, F_OK, 0) != -1) {
+            return 1;
+        }
+        i++;
+    }
+    // If not, we tell the user.
+    fprintf(stderr, "%s: command not found\n", program);
+    return 0;
+}
+
+//
+// Looks program up in the PATH index shared by all sessions with the same PATH.
+// Directory mtimes are checked at most once a second, and whichever session
+// first sees a stale directory rebuilds the index.
+// Returns 0 if the index is disabled or does not have the program, in which
+// case the caller falls back to searching the path directories.
+//
+int path_index_lookup(char *program, char **path, char full_path[MAX_LINE_CHARS]) {
+    if (getenv("JSH_PATH_INDEX") == NULL) {
+        return 0;
+    }
+
+    // The mapping is shared by every context in the process.
+    pthread_mutex_lock(&path_index_lock);
+
+    // The key is the joined PATH, worked out again only for a different path array.
+    if (path != path_index_path) {
+        size_t length = 1;
+        for (int i = 0; path[i] != NULL; i++) {
+            length += strlen(path[i]) + 1;
+        }
+        char *key = malloc(length);
+        key[0] = '\0';
+        for (int i = 0; path[i] != NULL; i++) {
+            if (i) {
+                strcat(key, ":");
+            }
+            strcat(key, path[i]);
+        }
+        if (path_index_key == NULL || strcmp(key, path_index_key) != 0) {
+            free(path_index_key);
+            path_index_key = key;
+            path_index_checked = 0;
+        } else {
+            free(key);
+        }
+        path_index_path = path;
+    }
+
+    time_t now = time(NULL);
+    if (path_index == NULL || now - path_index_checked >= PATH_INDEX_CHECK_SECONDS) {
+        if (path_index == NULL || !path_index_fresh(path_index, path, path_index_key)) {
+            path_index_refresh(path, path_index_key);
+        }
+        path_index_checked = now;
+    }
+    if (path_index == NULL) {
+        pthread_mutex_unlock(&path_index_lock);
+        return 0;
+    }
+
+    // Open addressing with linear probing, the slot count is a power of two.
+    char *base = (char *)path_index;
+    struct path_index_slot *slots = (struct path_index_slot *)(base + sizeof *path_index +
+            path_index->dir_count * sizeof (struct path_index_dir));
+    unsigned int mask = path_index->slot_count - 1;
+    for (unsigned int i = hash_string(program) & mask; slots[i].name != 0; i = (i + 1) & mask) {
+        if (strcmp(base + slots[i].name, program) == 0) {
+            snprintf(full_path, MAX_LINE_CHARS, "%s/%s", path[slots[i].dir], program);
+            pthread_mutex_unlock(&path_index_lock);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&path_index_lock);
+    return 0;
+}
+
+// Maps the current index for this PATH, rebuilding it under a lock if it is stale.
+void path_index_refresh(char **path, char *key) {
+    char file_path[PATH_BUFF_SIZE];
+    char lock_path[PATH_BUFF_SIZE + 8];
+    snprintf(file_path, PATH_BUFF_SIZE, "%s/jsh-path-%u-%lx", PATH_INDEX_DIR, (unsigned)getuid(), hash_string(key));
+    snprintf(lock_path, sizeof lock_path, "%s.lock", file_path);
+
+    // Another session may already have rebuilt it.
+    path_index_map(file_path);
+    if (path_index != NULL && path_index_fresh(path_index, path, key)) {
+        return;
+    }
+
+    // /dev/shm is shared, a lock someone else planted or linked is not used.
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    struct stat s;
+    if (lock == -1) {
+        return;
+    } else if (fstat(lock, &s) != 0 || s.st_uid != getuid()) {
+        close(lock);
+        return;
+    }
+    flock(lock, LOCK_EX);
+
+    // Check again now that we hold the lock, someone may have beaten us to it.
+    path_index_map(file_path);
+    if (path_index == NULL || !path_index_fresh(path_index, path, key)) {
+        if (path_index_build(file_path, path, key)) {
+            path_index_map(file_path);
+        }
+    }
+
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+// Checks the index is for this PATH and no directory has changed since it was built.
+int path_index_fresh(struct path_index_header *index, char **path, char *key) {
+    if (index->magic != PATH_INDEX_MAGIC || index->version != PATH_INDEX_VERSION ||
+            index->dir_count != (unsigned int)words_length(path) ||
+            strcmp((char *)index + index->key, key) != 0) {
+        return 0;
+    }
+
+    struct path_index_dir *dirs = (struct path_index_dir *)(index + 1);
+    for (unsigned int i = 0; i < index->dir_count; i++) {
+        struct path_index_dir mtime;
+        path_index_dir_mtime(path[i], &mtime);
+        if (mtime.mtime_sec != dirs[i].mtime_sec || mtime.mtime_nsec != dirs[i].mtime_nsec) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Replaces the current mapping with the index file, if it is valid and ours.
+void path_index_map(char *file_path) {
+    if (path_index != NULL) {
+        munmap(path_index, path_index->size);
+        path_index = NULL;
+    }
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat s;
+    if (fstat(fd, &s) == 0 && s.st_uid == getuid() && s.st_size >= (off_t)sizeof *path_index) {
+        void *map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            path_index = map;
+            if (path_index->magic != PATH_INDEX_MAGIC || path_index->size != (unsigned int)s.st_size) {
+                munmap(map, s.st_size);
+                path_index = NULL;
+            }
+        }
+    }
+    close(fd);
+}
+
+//
+// Scans every path directory and writes a new index file.
+// Earlier directories win, as in get_full_path. The file is written under
+// a temporary name and renamed so sessions never map a half written index.
+//
+int path_index_build(char *file_path, char **path, char *key) {
+    unsigned int dir_count = words_length(path);
+    struct path_index_dir *dirs = malloc(sizeof *dirs * (dir_count + 1));
+
+    size_t names_size = 64;
+    size_t name_count = 0;
+    size_t strings_size = 1 + strlen(key) + 1;
+    char **names = malloc(sizeof *names * names_size);
+    unsigned int *name_dirs = malloc(sizeof *name_dirs * names_size);
+
+    for (unsigned int i = 0; i < dir_count; i++) {
+        // Take the mtime first so changes made during the scan are noticed.
+        path_index_dir_mtime(path[i], &dirs[i]);
+        DIR *dir = opendir(path[i]);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (name_count == names_size) {
+                names_size *= 2;
+                names = realloc(names, sizeof *names * names_size);
+                name_dirs = realloc(name_dirs, sizeof *name_dirs * names_size);
+            }
+            names[name_count] = strdup(entry->d_name);
+            name_dirs[name_count] = i;
+            strings_size += strlen(entry->d_name) + 1;
+            name_count++;
+        }
+        closedir(dir);
+    }
+
+    unsigned int slot_count = 16;
+    while (slot_count < name_count * 2) {
+        slot_count *= 2;
+    }
+    size_t slots_offset = sizeof (struct path_index_header) + dir_count * sizeof *dirs;
+    size_t strings_offset = slots_offset + slot_count * sizeof (struct path_index_slot);
+    size_t size = strings_offset + strings_size;
+
+    char *buffer = calloc(1, size);
+    struct path_index_header *header = (struct path_index_header *)buffer;
+    struct path_index_slot *slots = (struct path_index_slot *)(buffer + slots_offset);
+    memcpy(buffer + sizeof *header, dirs, dir_count * sizeof *dirs);
+
+    // Offset 0 of the strings is left empty so 0 can mean an empty slot.
+    size_t used = strings_offset + 1;
+    header->key = used;
+    strcpy(buffer + used, key);
+    used += strlen(key) + 1;
+
+    unsigned int mask = slot_count - 1;
+    for (size_t n = 0; n < name_count; n++) {
+        unsigned int i = hash_string(names[n]) & mask;
+        while (slots[i].name != 0 && strcmp(buffer + slots[i].name, names[n]) != 0) {
+            i = (i + 1) & mask;
+        }
+        if (slots[i].name == 0) {
+            slots[i].name = used;
+            slots[i].dir = name_dirs[n];
+            strcpy(buffer + used, names[n]);
+            used += strlen(names[n]) + 1;
+        }
+        free(names[n]);
+    }
+    free(names);
+    free(name_dirs);
+    free(dirs);
+
+    header->magic = PATH_INDEX_MAGIC;
+    header->version = PATH_INDEX_VERSION;
+    header->dir_count = dir_count;
+    header->slot_count = slot_count;
+    header->size = used;
+
+    // A fresh name, so nothing already in /dev/shm is written through.
+    char temp_path[PATH_BUFF_SIZE + 16];
+    snprintf(temp_path, sizeof temp_path, "%s.XXXXXX", file_path);
+    int fd = mkostemp(temp_path, O_CLOEXEC);
+    int written = 0;
+    if (fd != -1) {
+        written = write(fd, buffer, used) == (ssize_t)used;
+        close(fd);
+        if (!written || rename(temp_path, file_path) != 0) {
+            unlink(temp_path);
+            written = 0;
+        }
+    }
+    free(buffer);
+    return written;
+}
+
+// Gets the mtime of a directory, a missing directory gets -1.
+void path_index_dir_mtime(char *dir, struct path_index_dir *mtime) {
+    struct stat s;
+    if (stat(dir, &s) == 0) {
+        mtime->mtime_sec = s.st_mtim.tv_sec;
+        mtime->mtime_nsec = s.st_mtim.tv_nsec;
+    } else {
+        mtime->mtime_sec = -1;
+        mtime->mtime_nsec = -1;
+    }
+}
+
+//
+// Reports that a pipeline has started, as one line of JSON:
+// {"event":"start","time":...,"shell_pid":...,"stages":[{"argv":[...],"pid":...}]}
+// pids is NULL when the shell is about to exec the command itself.
+//
+void event_start(char ***stage_words, pid_t *pids, int stages) {
+    if (events_fd == -1) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *stream = open_memstream(&text, &length);
+    fprintf(stream, "{\"event\":\"start\",\"time\":%ld.%06ld,\"shell_pid\":%d,\"stages\":[",
+            (long)now.tv_sec, now.tv_nsec / 1000, (int)getpid());
+    for (int i = 0; i < stages; i++) {
+        fprintf(stream, "%s{\"argv\":[", i ? "," : "");
+        for (int w = 0; stage_words[i][w] != NULL; w++) {
+            if (w) {
+                fputc(',', stream);
+            }
+            json_string(stream, stage_words[i][w]);
+        }
+        fprintf(stream, "],\"pid\":%d}", pids != NULL ? (int)pids[i] : (int)getpid());
+    }
+    fprintf(stream, "]}\n");
+    fclose(stream);
+    event_write(text, length);
+    free(text);
+}
+
+// Reports how each stage of a pipeline ended and what it used.
+void event_end(pid_t *pids, int *statuses, struct rusage *usages, int stages,
+        double duration, long bytes_in, long bytes_out) {
+    if (events_fd == -1) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *stream = open_memstream(&text, &length);
+    fprintf(stream, "{\"event\":\"end\",\"time\":%ld.%06ld,\"shell_pid\":%d,\"duration\":%.6f,"
+            "\"bytes_in\":%ld,\"bytes_out\":%ld,\"dropped\":%lu,\"stages\":[",
+            (long)now.tv_sec, now.tv_nsec / 1000, (int)getpid(), duration,
+            bytes_in, bytes_out, events_dropped);
+    for (int i = 0; i < stages; i++) {
+        int status = WIFEXITED(statuses[i]) ? WEXITSTATUS(statuses[i]) : 128 + WTERMSIG(statuses[i]);
+        fprintf(stream, "%s{\"pid\":%d,\"status\":%d,\"signal\":%d,\"utime\":%ld.%06ld,"
+                "\"stime\":%ld.%06ld,\"maxrss_kb\":%ld}",
+                i ? "," : "", (int)pids[i], status,
+                WIFSIGNALED(statuses[i]) ? WTERMSIG(statuses[i]) : 0,
+                (long)usages[i].ru_utime.tv_sec, (long)usages[i].ru_utime.tv_usec,
+                (long)usages[i].ru_stime.tv_sec, (long)usages[i].ru_stime.tv_usec,
+                usages[i].ru_maxrss);
+    }
+    fprintf(stream, "]}\n");
+    fclose(stream);
+    event_write(text, length);
+    free(text);
+}
+
+//
+// Queues a complete event and writes as much as the reader will take.
+// Whole events are dropped, and counted, once too much is waiting.
+//
+void event_write(char *text, size_t length) {
+    pthread_mutex_lock(&event_lock);
+    if (event_buffer_used + length > EVENT_BUFFER_MAX) {
+        events_dropped++;
+    } else {
+        if (event_buffer == NULL) {
+            event_buffer = malloc(EVENT_BUFFER_MAX);
+        }
+        memcpy(event_buffer + event_buffer_used, text, length);
+        event_buffer_used += length;
+    }
+    pthread_mutex_unlock(&event_lock);
+    event_flush();
+}
+
+// Writes buffered events without blocking, keeping whatever the reader won't take.
+void event_flush(void) {
+    if (events_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&event_lock);
+
+    // A reader that has gone away must not kill the shell with SIGPIPE.
+    sigset_t pipe_signal;
+    sigset_t old_mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+    size_t written = 0;
+    while (written < event_buffer_used) {
+        ssize_t n = write(events_fd, event_buffer + written, event_buffer_used - written);
+        if (n > 0) {
+            written += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                // The reader has gone away, stop producing events.
+                events_fd = -1;
+                written = event_buffer_used;
+            }
+            break;
+        }
+    }
+    memmove(event_buffer, event_buffer + written, event_buffer_used - written);
+    event_buffer_used -= written;
+
+    struct timespec no_wait = {0, 0};
+    if (!sigismember(&old_mask, SIGPIPE)) {
+        while (sigtimedwait(&pipe_signal, NULL, &no_wait) > 0) {
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_mutex_unlock(&event_lock);
+}
+
+// Writes s as a quoted JSON string.
+void json_string(FILE *stream, char *s) {
+    fputc('"', stream);
+    for (; *s != '\0'; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            fprintf(stream, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(stream, "\\u%04x", ch);
+        } else {
+            fputc(ch, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+// Seconds elapsed since start on the monotonic clock.
+double time_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//
+// Reaps the stages of a pipeline in the order they exit, noting when each did.
+// Each stage is watched through a pidfd so no other child is reaped, stages
+// without one are waited for in order at the end. Returns 0 if any wait failed.
+//
+int wait_stages(pid_t *pids, int stages, int *statuses, struct rusage *usages, struct timespec *exit_times) {
+    struct pollfd *polls = malloc(sizeof (struct pollfd) * (stages + 1));
+    int watched = 0;
+    for (int i = 0; i < stages; i++) {
+        polls[i].fd = syscall(SYS_pidfd_open, pids[i], 0);
+        polls[i].events = POLLIN;
+        watched += polls[i].fd != -1;
+    }
+
+    int waited = 1;
+    for (int i = 0; i < stages;) {
+        // Once nothing is left to poll the rest are waited for in order.
+        int ready = -1;
+        if (watched > 0) {
+            if (poll(polls, stages, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                for (int j = 0; j < stages; j++) {
+                    if (polls[j].fd >= 0) {
+                        close(polls[j].fd);
+                        polls[j].fd = -1;
+                    }
+                }
+                watched = 0;
+                continue;
+            }
+            for (int j = 0; j < stages && ready == -1; j++) {
+                if (polls[j].fd >= 0 && polls[j].revents) {
+                    ready = j;
+                    close(polls[j].fd);
+                    polls[j].fd = -2;
+                    watched--;
+                }
+            }
+            if (ready == -1) {
+                continue;
+            }
+        } else {
+            for (int j = 0; j < stages && ready == -1; j++) {
+                if (polls[j].fd == -1) {
+                    ready = j;
+                    polls[j].fd = -2;
+                }
+            }
+        }
+
+        if (wait4(pids[ready], &statuses[ready], 0, &usages[ready]) == -1) {
+            perror("waitpid");
+            statuses[ready] = 0;
+            memset(&usages[ready], 0, sizeof usages[ready]);
+            waited = 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &exit_times[ready]);
+        i++;
+    }
+    free(polls);
+    return waited;
+}
+
+//
+// Prints p50/p90/p99/max latencies for each command.
+// stats NAME only prints that command and stats reset clears everything.
+//
+void stats(char **words) {
+    if (words[1] != NULL && words[2] != NULL) {
+        fprintf(stderr, "stats: too many arguments\n");
+        ctx->last_status = 2;
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (words[1] != NULL && strcmp(words[1], "reset") == 0) {
+        memset(command_stats, 0, sizeof command_stats);
+        command_stats_count = 0;
+        pthread_mutex_unlock(&stats_lock);
+        ctx->last_status = 0;
+        return;
+    }
+
+    char *metric_names[STATS_METRICS] = {"wall", "spawn", "input"};
+    printf("%-20s %8s %-6s %10s %10s %10s %10s\n", "command", "count", "metric",
+            "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)");
+    for (int i = 0; i < command_stats_count; i++) {
+        struct command_stats *entry = &command_stats[i];
+        if (words[1] != NULL && strcmp(words[1], entry->name) != 0) {
+            continue;
+        }
+        for (int m = 0; m < STATS_METRICS; m++) {
+            struct histogram *histogram = &entry->metrics[m];
+            if (histogram->count == 0) {
+                continue;
+            }
+            printf("%-20s %8lu %-6s %10.3f %10.3f %10.3f %10.3f\n",
+                    m == 0 ? entry->name : "", histogram->count, metric_names[m],
+                    histogram_percentile(histogram, 0.50) / 1000.0,
+                    histogram_percentile(histogram, 0.90) / 1000.0,
+                    histogram_percentile(histogram, 0.99) / 1000.0,
+                    histogram->max / 1000.0);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    ctx->last_status = 0;
+}
+
+// Adds one latency sample for a command, keyed by the program's basename.
+void stats_record(char *program, int metric, double seconds) {
+    char *name = strrchr(program, '/');
+    name = (name != NULL && name[1] != '\0') ? name + 1 : program;
+    unsigned long value = seconds > 0 ? (unsigned long)(seconds * 1e6) : 0;
+
+    pthread_mutex_lock(&stats_lock);
+    int i = 0;
+    while (i < command_stats_count && strncmp(command_stats[i].name, name, STATS_NAME_CHARS - 1) != 0) {
+        i++;
+    }
+    if (i == command_stats_count) {
+        if (command_stats_count < STATS_MAX_COMMANDS) {
+            command_stats_count++;
+            snprintf(command_stats[i].name, STATS_NAME_CHARS, "%s", name);
+        } else {
+            i = STATS_MAX_COMMANDS - 1;
+            snprintf(command_stats[i].name, STATS_NAME_CHARS, "(other)");
+        }
+    }
+
+    struct histogram *histogram = &command_stats[i].metrics[metric];
+    histogram->buckets[histogram_bucket(value)]++;
+    histogram->count++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Finds the bucket for a value, see the STATS_BUCKETS comment.
+int histogram_bucket(unsigned long value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
+    }
+    int top_bit = 63 - __builtin_clzl(value);
+    int bucket = (top_bit - 3) * STATS_SUB_BUCKETS + ((value >> (top_bit - 4)) & (STATS_SUB_BUCKETS - 1));
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Returns the largest value that falls in a bucket.
+unsigned long histogram_value(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int top_bit = bucket / STATS_SUB_BUCKETS + 3;
+    unsigned long sub_bucket = bucket % STATS_SUB_BUCKETS;
+    return ((STATS_SUB_BUCKETS + sub_bucket + 1) << (top_bit - 4)) - 1;
+}
+
+// Returns the value below which the given fraction of samples fall.
+unsigned long histogram_percentile(struct histogram *histogram, double percentile) {
+    unsigned long wanted = (unsigned long)(percentile * histogram->count + 0.5);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= wanted) {
+            unsigned long value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Creates this session's metrics page, it is removed again when the shell exits.
+// jshstat removes the page of a shell killed before it could.
+void metrics_open(void) {
+    snprintf(metrics_path, PATH_BUFF_SIZE, "%s/%s%d", JSH_STATS_DIR, JSH_STATS_PREFIX, (int)getpid());
+    // The name is predictable, so only a file we create ourselves is used.
+    // A page left by an earlier shell with the same pid is removed first.
+    int flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = open(metrics_path, flags, 0644);
+    if (fd == -1 && errno == EEXIST && unlink(metrics_path) == 0) {
+        fd = open(metrics_path, flags, 0644);
+    }
+    if (fd == -1) {
+        return;
+    }
+    if (ftruncate(fd, sizeof *metrics_page) == 0) {
+        void *map = mmap(NULL, sizeof *metrics_page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            metrics_page = map;
+            metrics_page->pid = getpid();
+            metrics_page->version = JSH_STATS_VERSION;
+            __atomic_store_n(&metrics_page->magic, JSH_STATS_MAGIC, __ATOMIC_RELEASE);
+            atexit(metrics_close);
+        }
+    }
+    close(fd);
+    if (metrics_page == NULL) {
+        unlink(metrics_path);
+    }
+}
+
+// Removes the metrics page, before exiting or exec'ing another program.
+void metrics_close(void) {
+    if (metrics_page != NULL) {
+        munmap(metrics_page, sizeof *metrics_page);
+        metrics_page = NULL;
+        unlink(metrics_path);
+    }
+}
+
+// Adds to a counter under the page's sequence lock.
+void metrics_add(int counter, long delta) {
+    if (metrics_page == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&metrics_lock);
+    __atomic_store_n(&metrics_page->seq, metrics_page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    metrics_page->counters[counter] += delta;
+    __atomic_store_n(&metrics_page->seq, metrics_page->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+//
+// Starts paging in the program of every pipeline stage on another thread,
+// so the reads overlap with expansion and with spawning earlier stages.
+// Names are resolved here and kept in ctx->resolved for get_full_path, so
+// PATH is searched once per name. The thread only gets the files to read,
+// so it never touches the environment or the PATH index.
+//
+void prefetch_commands(char **words, char **path) {
+    if (ctx->resolved != NULL) {
+        free_tokens(ctx->resolved);
+        ctx->resolved = NULL;
+    }
+    int length = words_length(words);
+    if (length == 0) {
+        return;
+    }
+
+    char **files = malloc(sizeof (char *) * (length + 1));
+    char **resolved = malloc(sizeof (char *) * (length * 2 + 1));
+    int count = 0;
+    int resolved_count = 0;
+    int command_start = 1;
+    char full_path[MAX_LINE_CHARS];
+    for (int i = 0; i < length; i++) {
+        if (command_start && strpbrk(words[i], SPECIAL_CHARS "$\\") == NULL && !is_assignment(words[i]) &&
+                !is_builtin(words[i])) {
+            if (strchr(words[i], '/') != NULL) {
+                files[count++] = strdup(words[i]);
+            } else if (find_in_path(words[i], path, full_path)) {
+                files[count++] = strdup(full_path);
+                resolved[resolved_count++] = strdup(words[i]);
+                resolved[resolved_count++] = strdup(full_path);
+            }
+        }
+        command_start = (strcmp(words[i], "|") == 0 || (i == 1 && strcmp(words[0], "<") == 0));
+    }
+    files[count] = NULL;
+    resolved[resolved_count] = NULL;
+    ctx->resolved = resolved;
+    if (count == 0) {
+        free(files);
+        return;
+    }
+
+    // Files still queued belong to a line that has already run.
+    pthread_mutex_lock(&prefetch_lock);
+    if (!prefetch_started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        prefetch_started = pthread_create(&thread, &attr, prefetch_thread, NULL) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    if (prefetch_started) {
+        if (prefetch_queue != NULL) {
+            free_tokens(prefetch_queue);
+        }
+        prefetch_queue = files;
+        pthread_cond_signal(&prefetch_ready);
+    } else {
+        free_tokens(files);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Pages in each file execute_external is about to run, as prefetch_commands queues them.
+void *prefetch_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_queue == NULL) {
+            pthread_cond_wait(&prefetch_ready, &prefetch_lock);
+        }
+        char **files = prefetch_queue;
+        prefetch_queue = NULL;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        for (int i = 0; files[i] != NULL; i++) {
+            prefetch_file(files[i], 0);
+        }
+        free_tokens(files);
+    }
+    return NULL;
+}
+
+//
+// Asks the kernel to read a file ahead, then does the same for the ELF
+// interpreter or #! interpreter it names, since exec will need that too.
+//
+void prefetch_file(char *file_path, int depth) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    char interpreter[PATH_BUFF_SIZE];
+    interpreter[0] = '\0';
+
+    // One byte more than is read, so a #! line has room for its terminator.
+    union {
+        Elf64_Ehdr elf;
+        char text[sizeof (Elf64_Ehdr) + 1];
+    } header;
+    ssize_t n = pread(fd, &header, sizeof header.elf, 0);
+    if (n >= 2 && memcmp(header.text, "#!", 2) == 0) {
+        // Scripts name their interpreter on the first line.
+        header.text[n] = '\0';
+        char *line = header.text + 2;
+        line += strspn(line, " \t");
+        snprintf(interpreter, sizeof interpreter, "%.*s", (int)strcspn(line, " \t\n"), line);
+    } else if (n == sizeof header.elf && memcmp(header.elf.e_ident, ELFMAG, SELFMAG) == 0 &&
+            header.elf.e_ident[EI_CLASS] == ELFCLASS64) {
+        for (int i = 0; i < header.elf.e_phnum; i++) {
+            Elf64_Phdr program_header;
+            if (pread(fd, &program_header, sizeof program_header,
+                    header.elf.e_phoff + i * header.elf.e_phentsize) != sizeof program_header) {
+                break;
+            }
+            if (program_header.p_type == PT_INTERP && program_header.p_filesz < sizeof interpreter) {
+                if (pread(fd, interpreter, program_header.p_filesz, program_header.p_offset) > 0) {
+                    interpreter[program_header.p_filesz] = '\0';
+                }
+                break;
+            }
+        }
+    }
+    close(fd);
+
+    if (interpreter[0] == '/' && depth < 2) {
+        prefetch_file(interpreter, depth + 1);
+    }
+}
+
+//
+// Like get_full_path but silent, for lookups made before the line runs.
+// Uses AT_FDCWD rather than cwd_dir so it never touches the shell's directory state.
+//
+int find_in_path(char *program, char **path, char full_path[MAX_LINE_CHARS]) {
+    if (path_index_lookup(program, path, full_path)) {
+        metrics_add(JSH_PATH_HITS, 1);
+        return 1;
+    }
+    metrics_add(JSH_PATH_MISSES, 1);
+    for (int i = 0; path[i] != NULL; i++) {
+        snprintf(full_path, MAX_LINE_CHARS, "%s/%s", path[i], program);
+        if (faccessat(AT_FDCWD, full_path, F_OK, 0) != -1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copies the path prefetch_commands found for program, returns 0 if it found none.
+int find_resolved(char *program, char full_path[MAX_LINE_CHARS]) {
+    for (int i = 0; ctx->resolved != NULL && ctx->resolved[i] != NULL; i += 2) {
+        if (strcmp(ctx->resolved[i], program) == 0) {
+            snprintf(full_path, MAX_LINE_CHARS, "%s", ctx->resolved[i + 1]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Transports, an address without a known prefix is a unix socket path.
+static struct transport transports[] = {
+    {"unix:", unix_open, unix_listen},
+    {"ssh:", ssh_open, NULL},
+};
+
+//
+// Runs each line of a job file on a pool of jsh --worker processes.
+// eg. remote jobs.txt unix:/tmp/w1 unix:/tmp/w2 ssh:buildhost
+// Workers ask for a job whenever they are idle, so faster workers take more.
+// Output is passed through as it arrives and a job whose worker is lost is
+// given to another worker once. The exit status is 1 if any job failed.
+//
+void remote(char **words) {
+    if (words[1] == NULL || words[2] == NULL) {
+        fprintf(stderr, "remote: usage: remote jobfile worker [worker ...]\n");
+        ctx->last_status = 2;
+        return;
+    }
+
+    FILE *fp = strcmp(words[1], "-") == 0 ? stdin : fopen(words[1], "r");
+    if (fp == NULL) {
+        perror(words[1]);
+        ctx->last_status = 1;
+        return;
+    }
+    int job_count = 0;
+    char **jobs = malloc(sizeof (char *));
+    char line[MAX_LINE_CHARS];
+    while (fgets(line, MAX_LINE_CHARS, fp) != NULL) {
+        char *start = line + strspn(line, WORD_SEPARATORS);
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        start[strcspn(start, "\n")] = '\0';
+        jobs = realloc(jobs, sizeof (char *) * (job_count + 1));
+        jobs[job_count++] = strdup(start);
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    // The queue holds job numbers still to hand out, lost jobs go back on the end.
+    int *queue = malloc(sizeof (int) * job_count * 2 + 1);
+    int queue_length = job_count;
+    int *statuses = malloc(sizeof (int) * (job_count + 1));
+    int *attempts = calloc(job_count + 1, sizeof (int));
+    for (int i = 0; i < job_count; i++) {
+        queue[i] = job_count - 1 - i;
+        statuses[i] = -1;
+    }
+
+    // Writing to a worker that died must not kill the shell.
+    sigset_t pipe_signal;
+    sigset_t old_mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+    int worker_count = 0;
+    while (words[worker_count + 2] != NULL) {
+        worker_count++;
+    }
+    struct remote_worker *workers = calloc(worker_count, sizeof *workers);
+    struct pollfd *polls = malloc(sizeof *polls * worker_count);
+    int alive = 0;
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].address = words[i + 2];
+        workers[i].read_fd = -1;
+        workers[i].job = -1;
+        workers[i].pid = -1;
+        struct transport *transport = transport_find(workers[i].address);
+        if (transport->open(transport_address(transport, workers[i].address), &workers[i])) {
+            alive++;
+        } else {
+            fprintf(stderr, "remote: %s: could not connect\n", workers[i].address);
+        }
+    }
+
+    int done = 0;
+    while (alive > 0 && done < job_count) {
+        for (int i = 0; i < worker_count; i++) {
+            polls[i].fd = workers[i].read_fd;
+            polls[i].events = POLLIN;
+        }
+        if (poll(polls, worker_count, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < worker_count; i++) {
+            struct remote_worker *worker = &workers[i];
+            if (worker->read_fd == -1 || !(polls[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            // Gather input until there are whole frames to handle.
+            if (worker->buffer_size - worker->buffer_used < 65536) {
+                worker->buffer_size = worker->buffer_used + 65536;
+                worker->buffer = realloc(worker->buffer, worker->buffer_size);
+            }
+            ssize_t n = read(worker->read_fd, worker->buffer + worker->buffer_used,
+                    worker->buffer_size - worker->buffer_used);
+            int lost = n <= 0 && !(n == -1 && errno == EINTR);
+            if (n > 0) {
+                worker->buffer_used += n;
+            }
+
+            size_t used = 0;
+            while (!lost && worker->buffer_used - used >= FRAME_HEADER_SIZE) {
+                unsigned char *header = (unsigned char *)worker->buffer + used;
+                unsigned int length = (header[1] << 24) | (header[2] << 16) | (header[3] << 8) | header[4];
+                if (length > FRAME_MAX_PAYLOAD) {
+                    lost = 1;
+                    break;
+                }
+                if (worker->buffer_used - used < FRAME_HEADER_SIZE + length) {
+                    break;
+                }
+                int finished = worker->job;
+                if (!remote_handle_frame(worker, header[0], (char *)header + FRAME_HEADER_SIZE, length,
+                        jobs, queue, &queue_length, statuses, attempts)) {
+                    lost = 1;
+                }
+                if (finished != -1 && worker->job == -1 && statuses[finished] != -1) {
+                    done++;
+                }
+                used += FRAME_HEADER_SIZE + length;
+            }
+            memmove(worker->buffer, worker->buffer + used, worker->buffer_used - used);
+            worker->buffer_used -= used;
+
+            if (lost) {
+                // Give its job to someone else, but only once.
+                if (worker->job != -1) {
+                    if (attempts[worker->job] < 2) {
+                        queue[queue_length++] = worker->job;
+                    } else {
+                        fprintf(stderr, "remote: job %d (%s): worker %s lost\n",
+                                worker->job + 1, jobs[worker->job], worker->address);
+                        statuses[worker->job] = 255;
+                        done++;
+                    }
+                    worker->job = -1;
+                }
+                close(worker->read_fd);
+                if (worker->write_fd != worker->read_fd) {
+                    close(worker->write_fd);
+                }
+                worker->read_fd = -1;
+                worker->idle = 0;
+                alive--;
+            }
+        }
+
+        // Requeued jobs go to workers already waiting for one. A failed
+        // send shows up as a lost worker on the next poll.
+        for (int i = 0; i < worker_count && queue_length > 0; i++) {
+            if (workers[i].read_fd != -1 && workers[i].idle) {
+                remote_dispatch(&workers[i], jobs, queue, &queue_length, attempts);
+            }
+        }
+    }
+
+    // Tell idle workers we are done and collect any we started.
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].read_fd != -1) {
+            frame_write(workers[i].write_fd, FRAME_QUIT, NULL, 0);
+            close(workers[i].read_fd);
+            if (workers[i].write_fd != workers[i].read_fd) {
+                close(workers[i].write_fd);
+            }
+        }
+        if (workers[i].pid != -1) {
+            waitpid(workers[i].pid, NULL, 0);
+        }
+        free(workers[i].buffer);
+    }
+
+    // Throw away any SIGPIPE we caused before unblocking it.
+    struct timespec no_wait = {0, 0};
+    while (sigtimedwait(&pipe_signal, NULL, &no_wait) > 0) {
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    int failed = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (statuses[i] != 0) {
+            failed++;
+            if (statuses[i] == -1) {
+                fprintf(stderr, "remote: job %d (%s): not run\n", i + 1, jobs[i]);
+            }
+        }
+        free(jobs[i]);
+    }
+    if (failed) {
+        fprintf(stderr, "remote: %d of %d jobs failed\n", failed, job_count);
+    }
+    ctx->last_status = failed ? 1 : 0;
+
+    free(jobs);
+    free(queue);
+    free(statuses);
+    free(attempts);
+    free(workers);
+    free(polls);
+}
+
+// Acts on one frame from a worker, returns 0 if the worker can't be used any more.
+int remote_handle_frame(struct remote_worker *worker, char type, char *payload, unsigned int length,
+        char **jobs, int *queue, int *queue_length, int *statuses, int *attempts) {
+    if (type == FRAME_READY) {
+        if (*queue_length == 0) {
+            worker->idle = 1;
+            return 1;
+        }
+        return remote_dispatch(worker, jobs, queue, queue_length, attempts);
+    } else if (type == FRAME_STDOUT || type == FRAME_STDERR) {
+        int fd = type == FRAME_STDOUT ? 1 : 2;
+        if (fd == 1) {
+            fflush(stdout);
+        }
+        write_all(fd, payload, length);
+        return 1;
+    } else if (type == FRAME_EXIT && worker->job != -1) {
+        char status[16];
+        snprintf(status, sizeof status, "%.*s", (int)(length < 15 ? length : 15), payload);
+        statuses[worker->job] = atoi(status);
+        if (statuses[worker->job] != 0) {
+            fprintf(stderr, "remote: job %d (%s) on %s exited %d\n",
+                    worker->job + 1, jobs[worker->job], worker->address, statuses[worker->job]);
+        }
+        worker->job = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// Sends the worker the next job in the queue, returns 0 if it can't be sent.
+int remote_dispatch(struct remote_worker *worker, char **jobs, int *queue, int *queue_length, int *attempts) {
+    worker->idle = 0;
+    worker->job = queue[--*queue_length];
+    attempts[worker->job]++;
+    return frame_write(worker->write_fd, FRAME_JOB, jobs[worker->job], strlen(jobs[worker->job]));
+}
+
+//
+// Runs jobs sent by remote. With an address of - the coordinator is on
+// stdin and stdout, as when started over ssh. Otherwise the worker listens
+// on the address and serves one coordinator after another.
+//
+int worker_main(char *address, char **path) {
+    ctx->record_history = 0;
+    if (strcmp(address, "-") == 0) {
+        worker_serve(0, 1, path);
+        return 0;
+    }
+
+    struct transport *transport = transport_find(address);
+    if (transport->listen == NULL) {
+        fprintf(stderr, "jsh: --worker: %s: can't listen on this transport\n", address);
+        return 2;
+    }
+    address = transport_address(transport, address);
+    int listen_fd = transport->listen(address);
+    if (listen_fd == -1) {
+        perror(address);
+        return 1;
+    }
+
+    // A coordinator that goes away mid-job must only end that connection.
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        int connection = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (connection == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        worker_serve(connection, connection, path);
+        close(connection);
+    }
+}
+
+// Asks for jobs and runs them until the coordinator says to quit or goes away.
+void worker_serve(int read_fd, int write_fd, char **path) {
+    while (frame_write(write_fd, FRAME_READY, NULL, 0)) {
+        char type;
+        char *payload;
+        unsigned int length;
+        if (!frame_read(read_fd, &type, &payload, &length)) {
+            return;
+        }
+        if (type != FRAME_JOB) {
+            free(payload);
+            return;
+        }
+        int sent = worker_run_job(payload, write_fd, path);
+        free(payload);
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+//
+// Runs one job in a child jsh, streaming its output back as frames.
+// Returns 0 if the coordinator could not be written to.
+//
+int worker_run_job(char *line, int write_fd, char **path) {
+    extern char **environ;
+    int out[2];
+    int err[2];
+    if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+        return frame_write(write_fd, FRAME_EXIT, "126", 3);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The child runs the line like an embedded shell, so it can't exit or exec the worker.
+        int null_fd = open("/dev/null", O_RDONLY);
+        dup2(null_fd, 0);
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+        ctx->embedded = 1;
+        ctx->tail_exec = 0;
+        run_line(line, path, environ);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ctx->last_status);
+    }
+    close(out[1]);
+    close(err[1]);
+    if (pid == -1) {
+        close(out[0]);
+        close(err[0]);
+        return frame_write(write_fd, FRAME_EXIT, "126", 3);
+    }
+
+    int sent = 1;
+    struct pollfd polls[2] = {{out[0], POLLIN, 0}, {err[0], POLLIN, 0}};
+    char buffer[65536];
+    while (polls[0].fd != -1 || polls[1].fd != -1) {
+        if (poll(polls, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (polls[i].fd == -1 || !polls[i].revents) {
+                continue;
+            }
+            ssize_t n = read(polls[i].fd, buffer, sizeof buffer);
+            if (n > 0) {
+                sent = sent && frame_write(write_fd, i == 0 ? FRAME_STDOUT : FRAME_STDERR, buffer, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(polls[i].fd);
+                polls[i].fd = -1;
+            }
+        }
+    }
+
+    int status;
+    char status_text[16];
+    waitpid(pid, &status, 0);
+    snprintf(status_text, sizeof status_text, "%d",
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return sent && frame_write(write_fd, FRAME_EXIT, status_text, strlen(status_text));
+}
+
+// Finds the transport for an address, anything unknown is a unix socket path.
+struct transport *transport_find(char *address) {
+    for (size_t i = 0; i < sizeof transports / sizeof transports[0]; i++) {
+        if (strncmp(address, transports[i].prefix, strlen(transports[i].prefix)) == 0) {
+            return &transports[i];
+        }
+    }
+    return &transports[0];
+}
+
+// Strips the transport prefix, if it was given, off an address.
+char *transport_address(struct transport *transport, char *address) {
+    size_t length = strlen(transport->prefix);
+    return strncmp(address, transport->prefix, length) == 0 ? address + length : address;
+}
+
+// Connects to a worker listening on a unix socket.
+int unix_open(char *address, struct remote_worker *worker) {
+    struct sockaddr_un socket_address;
+    memset(&socket_address, 0, sizeof socket_address);
+    socket_address.sun_family = AF_UNIX;
+    snprintf(socket_address.sun_path, sizeof socket_address.sun_path, "%s", address);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    if (connect(fd, (struct sockaddr *)&socket_address, sizeof socket_address) == -1) {
+        close(fd);
+        return 0;
+    }
+    worker->read_fd = fd;
+    worker->write_fd = fd;
+    return 1;
+}
+
+// Listens on a unix socket, replacing any socket left behind at that path.
+int unix_listen(char *address) {
+    struct sockaddr_un socket_address;
+    memset(&socket_address, 0, sizeof socket_address);
+    socket_address.sun_family = AF_UNIX;
+    snprintf(socket_address.sun_path, sizeof socket_address.sun_path, "%s", address);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(address);
+    if (bind(fd, (struct sockaddr *)&socket_address, sizeof socket_address) == -1 || listen(fd, 16) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Starts jsh --worker - on another host with ssh and talks to it over the pipes.
+int ssh_open(char *address, struct remote_worker *worker) {
+    extern char **environ;
+    char full_path[MAX_LINE_CHARS];
+    if (!find_in_path("ssh", ctx->path, full_path)) {
+        return 0;
+    }
+
+    int to_worker[2];
+    int from_worker[2];
+    if (pipe2(to_worker, O_CLOEXEC) == -1) {
+        return 0;
+    }
+    if (pipe2(from_worker, O_CLOEXEC) == -1) {
+        close(to_worker[0]);
+        close(to_worker[1]);
+        return 0;
+    }
+
+    char *argv[] = {"ssh", "-T", address, "jsh", "--worker", "-", NULL};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_worker[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, from_worker[1], 1);
+    int spawned = posix_spawn(&worker->pid, full_path, &actions, NULL, argv, environ) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    close(to_worker[0]);
+    close(from_worker[1]);
+    if (!spawned) {
+        close(to_worker[1]);
+        close(from_worker[0]);
+        worker->pid = -1;
+        return 0;
+    }
+    worker->read_fd = from_worker[0];
+    worker->write_fd = to_worker[1];
+    return 1;
+}
+
+// Sends a frame: a type byte, a 4 byte big-endian length and the payload.
+int frame_write(int fd, char type, char *payload, unsigned int length) {
+    char header[FRAME_HEADER_SIZE] = {type, length >> 24, length >> 16, length >> 8, length};
+    struct iovec parts[2] = {{header, FRAME_HEADER_SIZE}, {payload, length}};
+    size_t total = FRAME_HEADER_SIZE + length;
+    size_t written = 0;
+    while (written < total) {
+        ssize_t n = writev(fd, parts, length ? 2 : 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        written += n;
+        // Move past whatever part was written.
+        for (int i = 0; i < 2 && n > 0; i++) {
+            size_t step = (size_t)n < parts[i].iov_len ? (size_t)n : parts[i].iov_len;
+            parts[i].iov_base = (char *)parts[i].iov_base + step;
+            parts[i].iov_len -= step;
+            n -= step;
+        }
+    }
+    return 1;
+}
+
+// Reads one whole frame, the payload is NUL-terminated and must be freed.
+int frame_read(int fd, char *type, char **payload, unsigned int *length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (!read_full(fd, (char *)header, FRAME_HEADER_SIZE)) {
+        return 0;
+    }
+    *type = header[0];
+    *length = (header[1] << 24) | (header[2] << 16) | (header[3] << 8) | header[4];
+    if (*length > FRAME_MAX_PAYLOAD) {
+        return 0;
+    }
+    *payload = malloc(*length + 1);
+    if (!read_full(fd, *payload, *length)) {
+        free(*payload);
+        return 0;
+    }
+    (*payload)[*length] = '\0';
+    return 1;
+}
+
+// Writes all of buffer, returns 0 on error.
+int write_all(int fd, char *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, buffer + done, length - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+// Reads exactly length bytes, returns 0 on end of file or error.
+int read_full(int fd, char *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, buffer + done, length - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+//
+// find [path ...] [expression]
+// Walks each path with a thread per CPU, printing what the expression matches
+// as each directory is read, so the order is not fixed. Supported are -name,
+// -path, -type, -newer, -size, -mtime, -prune, -print, -print0 and -o.
+// Files are only stat'd when -newer, -size or -mtime needs it, or when
+// the file system doesn't give the type.
+//
+void find(char **words) {
+    int start = 1;
+    while (words[start] != NULL && words[start][0] != '-') {
+        start++;
+    }
+
+    struct find_walk walk;
+    memset(&walk, 0, sizeof walk);
+    if (!find_parse(words + start, &walk)) {
+        free(walk.tests);
+        ctx->last_status = 1;
+        return;
+    }
+    walk.now = time(NULL);
+    walk.out_fd = (ctx->fds[1] != -1) ? ctx->fds[1] : 1;
+    walk.cwd = cwd_dir();
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.work, NULL);
+    pthread_mutex_init(&walk.output_lock, NULL);
+    fflush(stdout);
+
+    struct find_output *output = malloc(sizeof *output);
+    output->used = 0;
+    char *dot[] = {".", NULL};
+    char **paths = (start == 1) ? dot : words + 1;
+    int path_count = (start == 1) ? 1 : start - 1;
+    for (int i = 0; i < path_count; i++) {
+        struct find_entry entry = {paths[i], strlen(paths[i]), paths[i], walk.cwd, DT_UNKNOWN, 0, {0}, 0};
+        if (!find_stat(&walk, &entry)) {
+            continue;
+        }
+        // Stat'd from the whole path, but -name sees only the last part.
+        char name[PATH_MAX];
+        find_start_name(paths[i], name, sizeof name);
+        entry.name = name;
+        find_matches(&walk, &entry, output);
+        if (S_ISDIR(entry.st.st_mode) && !entry.prune) {
+            struct find_dir *dir = malloc(sizeof *dir + entry.path_length + 1);
+            memcpy(dir->path, entry.path, entry.path_length + 1);
+            dir->next = NULL;
+            find_push(&walk, dir);
+        }
+    }
+    find_flush(&walk, output);
+    free(output);
+
+    int threads_wanted = thread_count(FIND_MAX_THREADS);
+    pthread_t threads[FIND_MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads_wanted; t++) {
+        if (pthread_create(&threads[started], NULL, find_worker, &walk) == 0) {
+            started++;
+        }
+    }
+    find_worker(&walk);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.work);
+    pthread_mutex_destroy(&walk.output_lock);
+    free(walk.tests);
+    ctx->last_status = walk.failed ? 1 : 0;
+}
+
+//
+// Gives the name -name matches for a start path, its last component
+// without trailing slashes, as GNU find does.
+// eg. "./src" and "src/" both give "src", "/" gives "/"
+//
+void find_start_name(char *path, char *name, size_t size) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    size_t begin = length;
+    while (begin > 0 && path[begin - 1] != '/') {
+        begin--;
+    }
+    if (begin == length) {
+        begin = 0;
+    }
+    snprintf(name, size, "%.*s", (int)(length - begin), path + begin);
+}
+
+//
+// True if the builtin find understands every word, the same paths then
+// predicates split find() makes. Anything else, like -exec, -maxdepth or
+// ! and ( ), is for the external find.
+//
+int find_supported(char **words) {
+    static char *with_value[] = {"-name", "-path", "-type", "-newer", "-size", "-mtime", NULL};
+    static char *without_value[] = {"-o", "-prune", "-print", "-print0", NULL};
+    int i = 1;
+    for (; words[i] != NULL && words[i][0] != '-'; i++) {
+        if (strcmp(words[i], "!") == 0 || strcmp(words[i], "(") == 0 || strcmp(words[i], ")") == 0) {
+            return 0;
+        }
+    }
+    while (words[i] != NULL) {
+        int known = 0;
+        for (int j = 0; with_value[j] != NULL && !known; j++) {
+            known = strcmp(words[i], with_value[j]) == 0;
+        }
+        if (known) {
+            i += (words[i + 1] != NULL) ? 2 : 1;
+            continue;
+        }
+        for (int j = 0; without_value[j] != NULL && !known; j++) {
+            known = strcmp(words[i], without_value[j]) == 0;
+        }
+        if (!known) {
+            return 0;
+        }
+        i++;
+    }
+    return 1;
+}
+
+// Turns the expression words into tests, returns 0 after printing an error.
+int find_parse(char **words, struct find_walk *walk) {
+    int count = words_length(words);
+    walk->tests = calloc(count + 1, sizeof (struct find_test));
+    for (int i = 0; words[i] != NULL; i++) {
+        struct find_test *test = &walk->tests[walk->test_count++];
+        char *option = words[i];
+        int takes_value = strcmp(option, "-name") == 0 || strcmp(option, "-path") == 0 ||
+                strcmp(option, "-type") == 0 || strcmp(option, "-newer") == 0 ||
+                strcmp(option, "-size") == 0 || strcmp(option, "-mtime") == 0;
+        if (takes_value && words[i + 1] == NULL) {
+            fprintf(stderr, "find: missing argument to `%s'\n", option);
+            return 0;
+        }
+        char *value = takes_value ? words[++i] : NULL;
+
+        if (strcmp(option, "-o") == 0) {
+            test->kind = FIND_OR;
+        } else if (strcmp(option, "-name") == 0 || strcmp(option, "-path") == 0) {
+            test->kind = (option[1] == 'n') ? FIND_NAME : FIND_PATH;
+            test->pattern = value;
+        } else if (strcmp(option, "-type") == 0) {
+            int types[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK};
+            char *letter = strchr("fdlpscb", value[0]);
+            if (letter == NULL || value[0] == '\0' || value[1] != '\0') {
+                fprintf(stderr, "find: unknown argument to -type: %s\n", value);
+                return 0;
+            }
+            test->kind = FIND_TYPE;
+            test->type = types[letter - "fdlpscb"];
+        } else if (strcmp(option, "-newer") == 0) {
+            struct stat st;
+            if (fstatat(cwd_dir(), value, &st, 0) == -1) {
+                perror(value);
+                return 0;
+            }
+            test->kind = FIND_NEWER;
+            test->newer = st.st_mtim;
+        } else if (strcmp(option, "-size") == 0 || strcmp(option, "-mtime") == 0) {
+            test->kind = (option[1] == 's') ? FIND_SIZE : FIND_MTIME;
+            test->sign = (value[0] == '+') ? 1 : (value[0] == '-') ? -1 : 0;
+            char *end;
+            test->number = strtoll(value + (test->sign != 0), &end, 10);
+            test->unit = (test->kind == FIND_SIZE) ? 512 : 86400;
+            if (test->kind == FIND_SIZE && *end != '\0' && end[1] == '\0') {
+                char *unit = strchr("cwbkMG", *end);
+                long long units[] = {1, 2, 512, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+                if (unit != NULL) {
+                    test->unit = units[unit - "cwbkMG"];
+                    end++;
+                }
+            }
+            if (end == value + (test->sign != 0) || *end != '\0') {
+                fprintf(stderr, "find: invalid argument `%s' to `%s'\n", value, option);
+                return 0;
+            }
+        } else if (strcmp(option, "-prune") == 0) {
+            test->kind = FIND_PRUNE;
+        } else if (strcmp(option, "-print") == 0 || strcmp(option, "-print0") == 0) {
+            test->kind = (option[6] == '0') ? FIND_PRINT0 : FIND_PRINT;
+            walk->has_action = 1;
+        } else {
+            fprintf(stderr, "find: unknown predicate `%s'\n", option);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//
+// Runs the expression on a file, printing it if an action or the implicit
+// -print says to. Returns whether the expression was true.
+//
+int find_matches(struct find_walk *walk, struct find_entry *entry, struct find_output *output) {
+    int result = 1;
+    for (int i = 0; i < walk->test_count; i++) {
+        struct find_test *test = &walk->tests[i];
+        if (test->kind == FIND_OR) {
+            if (result) {
+                break;
+            }
+            result = 1;
+            continue;
+        }
+        if (!result) {
+            continue;
+        }
+        switch (test->kind) {
+        case FIND_NAME:
+            result = fnmatch(test->pattern, entry->name, 0) == 0;
+            break;
+        case FIND_PATH:
+            result = fnmatch(test->pattern, entry->path, 0) == 0;
+            break;
+        case FIND_TYPE:
+            if (entry->type == DT_UNKNOWN && find_stat(walk, entry)) {
+                entry->type = IFTODT(entry->st.st_mode);
+            }
+            result = entry->type == test->type;
+            break;
+        case FIND_NEWER:
+            result = find_stat(walk, entry) &&
+                    (entry->st.st_mtim.tv_sec > test->newer.tv_sec ||
+                    (entry->st.st_mtim.tv_sec == test->newer.tv_sec &&
+                    entry->st.st_mtim.tv_nsec > test->newer.tv_nsec));
+            break;
+        case FIND_SIZE:
+            result = find_stat(walk, entry) &&
+                    find_compare(test, (entry->st.st_size + test->unit - 1) / test->unit);
+            break;
+        case FIND_MTIME:
+            result = find_stat(walk, entry) &&
+                    find_compare(test, (walk->now - entry->st.st_mtim.tv_sec) / test->unit);
+            break;
+        case FIND_PRUNE:
+            entry->prune = 1;
+            break;
+        case FIND_PRINT:
+        case FIND_PRINT0:
+            find_emit(walk, output, entry->path, entry->path_length, test->kind == FIND_PRINT0 ? '\0' : '\n');
+            break;
+        }
+    }
+    if (result && !walk->has_action) {
+        find_emit(walk, output, entry->path, entry->path_length, '\n');
+    }
+    return result;
+}
+
+// Stats the file if it hasn't been already, returns 0 if it can't be.
+int find_stat(struct find_walk *walk, struct find_entry *entry) {
+    if (entry->have_stat) {
+        return 1;
+    }
+    if (fstatat(entry->dir_fd, entry->name, &entry->st, AT_SYMLINK_NOFOLLOW) == -1) {
+        fprintf(stderr, "find: '%s': %s\n", entry->path, strerror(errno));
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    entry->have_stat = 1;
+    return 1;
+}
+
+// Compares as -size and -mtime do, +n is more than n and -n less than n.
+int find_compare(struct find_test *test, long long value) {
+    if (test->sign > 0) {
+        return value > test->number;
+    } else if (test->sign < 0) {
+        return value < test->number;
+    }
+    return value == test->number;
+}
+
+// Queues a list of directories for the threads.
+void find_push(struct find_walk *walk, struct find_dir *dirs) {
+    struct find_dir *last = dirs;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    pthread_mutex_lock(&walk->lock);
+    last->next = walk->queue;
+    walk->queue = dirs;
+    pthread_cond_broadcast(&walk->work);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Reads queued directories until the queue is empty and no thread can add to it.
+void *find_worker(void *arg) {
+    struct find_walk *walk = arg;
+    struct find_output *output = malloc(sizeof *output);
+    output->used = 0;
+
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (walk->queue == NULL && walk->busy > 0) {
+            pthread_cond_wait(&walk->work, &walk->lock);
+        }
+        if (walk->queue == NULL) {
+            break;
+        }
+        struct find_dir *dir = walk->queue;
+        walk->queue = dir->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        find_read_dir(walk, dir->path, output);
+        find_flush(walk, output);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->busy == 0 && walk->queue == NULL) {
+            pthread_cond_broadcast(&walk->work);
+        }
+    }
+    pthread_mutex_unlock(&walk->lock);
+    free(output);
+    return NULL;
+}
+
+// Runs the expression on everything in a directory and queues its subdirectories.
+void find_read_dir(struct find_walk *walk, char *path, struct find_output *output) {
+    int fd = openat(walk->cwd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "find: '%s': %s\n", path, strerror(errno));
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t path_length = strlen(path);
+    int needs_slash = path[path_length - 1] != '/';
+    size_t size = path_length + 256 + 2;
+    char *child = malloc(size);
+    memcpy(child, path, path_length);
+    if (needs_slash) {
+        child[path_length] = '/';
+    }
+    char *name = child + path_length + needs_slash;
+
+    struct find_dir *found = NULL;
+    char buffer[32768];
+    ssize_t n;
+    while ((n = getdents64(fd, buffer, sizeof buffer)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buffer + offset);
+            offset += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+                    (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            size_t name_length = strlen(d->d_name);
+            memcpy(name, d->d_name, name_length + 1);
+
+            struct find_entry entry = {child, name - child + name_length, name, fd, d->d_type, 0, {0}, 0};
+            find_matches(walk, &entry, output);
+            if (entry.type == DT_UNKNOWN && find_stat(walk, &entry)) {
+                entry.type = IFTODT(entry.st.st_mode);
+            }
+            if (entry.type == DT_DIR && !entry.prune) {
+                struct find_dir *dir = malloc(sizeof *dir + entry.path_length + 1);
+                memcpy(dir->path, child, entry.path_length + 1);
+                dir->next = found;
+                found = dir;
+            }
+        }
+    }
+    if (n == -1) {
+        fprintf(stderr, "find: '%s': %s\n", path, strerror(errno));
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+    }
+    close(fd);
+    free(child);
+    if (found != NULL) {
+        find_push(walk, found);
+    }
+}
+
+// Adds a path to the thread's output, writing it out first if it is full.
+void find_emit(struct find_walk *walk, struct find_output *output, char *path, size_t length, char end) {
+    if (output->used + length + 1 > FIND_BUFFER_SIZE) {
+        find_flush(walk, output);
+    }
+    if (length + 1 > FIND_BUFFER_SIZE) {
+        pthread_mutex_lock(&walk->output_lock);
+        write_all(walk->out_fd, path, length);
+        write_all(walk->out_fd, &end, 1);
+        pthread_mutex_unlock(&walk->output_lock);
+        return;
+    }
+    memcpy(output->buffer + output->used, path, length);
+    output->buffer[output->used + length] = end;
+    output->used += length + 1;
+}
+
+// Writes out what a thread has found, whole paths at a time.
+void find_flush(struct find_walk *walk, struct find_output *output) {
+    if (output->used == 0) {
+        return;
+    }
+    pthread_mutex_lock(&walk->output_lock);
+    write_all(walk->out_fd, output->buffer, output->used);
+    pthread_mutex_unlock(&walk->output_lock);
+    output->used = 0;
+}
+
+//
+// Takes |pv| out of the words and marks the pipe it was in as metered.
+// Returns the number of meters found.
+// eg. {"a", "|", "pv", "|", "b", NULL} becomes {"a", "|", "b", NULL} with metered[0] set.
+//
+int strip_meters(char **words, int *metered) {
+    int meters = 0;
+    int pipe_index = 0;
+    int length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (strcmp(words[i], "|") == 0 && words[i + 1] != NULL && strcmp(words[i + 1], METER_WORD) == 0 &&
+                words[i + 2] != NULL && strcmp(words[i + 2], "|") == 0) {
+            metered[pipe_index] = 1;
+            meters++;
+            i += 2;
+        }
+        if (strcmp(words[i], "|") == 0) {
+            pipe_index++;
+        }
+        words[length++] = words[i];
+    }
+    words[length] = NULL;
+    return meters;
+}
+
+//
+// Moves everything from one pipe to the next with splice, so the data
+// is counted without being copied into the shell.
+//
+void *meter_thread(void *arg) {
+    struct pipe_meter *meter = arg;
+
+    // A reader that goes away should show up as EPIPE here, not kill the shell.
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        ssize_t moved = splice(meter->in, NULL, meter->out, NULL, 1 << 16, SPLICE_F_MOVE);
+        if (moved > 0) {
+            meter->bytes += moved;
+        } else if (moved == -1 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+    meter->seconds = time_since(&start);
+
+    // Closing our end gives the writer SIGPIPE if the reader has gone.
+    close(meter->in);
+    close(meter->out);
+    return NULL;
+}
+
+// Prints the throughput of a metered pipe and sends it as an event.
+void meter_report(struct pipe_meter *meter, char *from, char *to) {
+    double rate = meter->seconds > 0 ? meter->bytes / meter->seconds : 0;
+    fprintf(stderr, "pv %s -> %s: %lld bytes in %.3fs (%.2f MB/s)\n",
+            from, to, meter->bytes, meter->seconds, rate / 1e6);
+
+    if (events_fd == -1) {
+        return;
+    }
+    char *text = NULL;
+    size_t length = 0;
+    FILE *stream = open_memstream(&text, &length);
+    fprintf(stream, "{\"event\":\"meter\",\"shell_pid\":%d,\"from\":", (int)getpid());
+    json_string(stream, from);
+    fprintf(stream, ",\"to\":");
+    json_string(stream, to);
+    fprintf(stream, ",\"bytes\":%lld,\"seconds\":%.6f,\"bytes_per_second\":%.0f}\n",
+            meter->bytes, meter->seconds, rate);
+    fclose(stream);
+    event_write(text, length);
+    free(text);
+}
+
+//
+// Samples a running pipeline until every stage has exited, then reports
+// on stderr which stage was the bottleneck and where backpressure built up.
+// The shell holds the read end of each pipe between stages so FIONREAD
+// can show how full it is, and closes it once the stage reading it exits
+// so writers still get SIGPIPE. Stages are left for the caller to reap.
+//
+void profile_wait(char ***stage_words, pid_t *pids, int stages, int *pipe_array) {
+    int pipes = stages - 1;
+    int *alive = malloc(sizeof (int) * stages);
+    double *cpu = calloc(stages, sizeof (double));
+    long *capacity = malloc(sizeof (long) * pipes);
+    long *fill_total = calloc(pipes, sizeof (long));
+    long *fill_max = calloc(pipes, sizeof (long));
+    long *full_samples = calloc(pipes, sizeof (long));
+    long samples = 0;
+
+    for (int i = 0; i < stages; i++) {
+        alive[i] = 1;
+    }
+    for (int i = 0; i < pipes; i++) {
+        capacity[i] = fcntl(pipe_array[i * 2], F_GETPIPE_SZ);
+        if (capacity[i] <= 0) {
+            capacity[i] = 65536;
+        }
+    }
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    int running = stages;
+    while (running > 0) {
+        for (int i = 0; i < stages; i++) {
+            if (!alive[i]) {
+                continue;
+            }
+            // An exited stage is a zombie until reaped, so its times can still be read.
+            cpu[i] = process_cpu_time(pids[i]);
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, pids[i], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pids[i]) {
+                alive[i] = 0;
+                running--;
+                if (i > 0) {
+                    close(pipe_array[(i - 1) * 2]);
+                    pipe_array[(i - 1) * 2] = -1;
+                }
+            }
+        }
+
+        for (int i = 0; i < pipes; i++) {
+            int queued = 0;
+            if (pipe_array[i * 2] == -1 || ioctl(pipe_array[i * 2], FIONREAD, &queued) == -1) {
+                continue;
+            }
+            fill_total[i] += queued;
+            if (queued > fill_max[i]) {
+                fill_max[i] = queued;
+            }
+            if (queued >= capacity[i] * 9 / 10) {
+                full_samples[i]++;
+            }
+        }
+        samples++;
+
+        if (running > 0) {
+            poll(NULL, 0, PROFILE_INTERVAL_MS);
+        }
+    }
+    double wall = time_since(&start_time);
+
+    // The stage reading the fullest pipe is falling behind, otherwise blame the busiest stage.
+    int busiest = 0;
+    for (int i = 1; i < stages; i++) {
+        if (cpu[i] > cpu[busiest]) {
+            busiest = i;
+        }
+    }
+    int fullest = -1;
+    for (int i = 0; i < pipes; i++) {
+        if (full_samples[i] * 2 > samples && (fullest == -1 || fill_total[i] > fill_total[fullest])) {
+            fullest = i;
+        }
+    }
+    int bottleneck = fullest != -1 ? fullest + 1 : busiest;
+
+    fprintf(stderr, "profile: %.3fs wall, %ld samples every %dms\n", wall, samples, PROFILE_INTERVAL_MS);
+    for (int i = 0; i < stages; i++) {
+        fprintf(stderr, "  stage %d %-16s cpu %8.3fs %5.1f%%%s\n", i, stage_words[i][0], cpu[i],
+                wall > 0 ? 100 * cpu[i] / wall : 0.0, i == bottleneck ? "  <- bottleneck" : "");
+        if (i < pipes) {
+            fprintf(stderr, "    pipe %d->%d avg %ld max %ld of %ld bytes, full %ld%% of samples\n",
+                    i, i + 1, samples ? fill_total[i] / samples : 0, fill_max[i], capacity[i],
+                    samples ? 100 * full_samples[i] / samples : 0);
+        }
+    }
+    if (fullest != -1) {
+        fprintf(stderr, "profile: backpressure on pipe %d->%d, %s is the slow consumer\n",
+                fullest, fullest + 1, stage_words[fullest + 1][0]);
+    } else {
+        fprintf(stderr, "profile: no backpressure, %s used the most cpu\n", stage_words[busiest][0]);
+    }
+
+    for (int i = 0; i < pipes; i++) {
+        if (pipe_array[i * 2] != -1) {
+            close(pipe_array[i * 2]);
+        }
+    }
+    free(alive);
+    free(cpu);
+    free(capacity);
+    free(fill_total);
+    free(fill_max);
+    free(full_samples);
+}
+
+// Returns user plus system cpu seconds used so far by a process.
+double process_cpu_time(pid_t pid) {
+    char stat_path[64];
+    snprintf(stat_path, sizeof stat_path, "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(stat_path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[MAX_LINE_CHARS];
+    double seconds = 0;
+    if (fgets(line, MAX_LINE_CHARS, fp) != NULL) {
+        // The command name may contain spaces, so fields are counted after its ')'.
+        char *fields = strrchr(line, ')');
+        unsigned long utime;
+        unsigned long stime;
+        if (fields != NULL && sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) == 2) {
+            seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    fclose(fp);
+    return seconds;
+}
+
+// Sources ~/.jshrc, saving the state it leaves behind if image_path is given.
+void load_rc(char **path, char *image_path) {
+    extern char **environ;
+
+    // Copy the environment so the image only keeps what the rc file changed.
+    char **old_environment = NULL;
+    if (image_path != NULL) {
+        old_environment = malloc(sizeof (char *) * (words_length(environ) + 1));
+        int i = 0;
+        for (; environ[i] != NULL; i++) {
+            old_environment[i] = strdup(environ[i]);
+        }
+        old_environment[i] = NULL;
+        image_recording = 1;
+    }
+
+    char *rc_path = get_file_in_home(RC_FILE);
+    if (access(rc_path, F_OK) == 0) {
+        source_file(rc_path, path);
+    } else if (image_recording) {
+        // A missing file hashes to 0, so the image goes stale once one is created.
+        image_sources = realloc(image_sources, sizeof (char *) * (image_source_count + 1));
+        image_sources[image_source_count++] = strdup(rc_path);
+    }
+    free(rc_path);
+
+    if (image_path != NULL) {
+        image_recording = 0;
+        if (!image_save(image_path, old_environment)) {
+            perror(image_path);
+        }
+        free_tokens(old_environment);
+    }
+}
+
+//
+// Loads the aliases and variables saved by --save-image.
+// The image is only used if every file sourced when it was saved still
+// has the same contents. Variables point straight into the mapping.
+// Returns 0 if the image can't be used.
+//
+int image_load(char *image_path) {
+    int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size < (off_t)sizeof (struct image_header)) {
+        close(fd);
+        return 0;
+    }
+    char *base = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+
+    struct image_header *header = (struct image_header *)base;
+    size_t tables_size = header->file_count * sizeof (struct image_file) +
+            header->env_count * sizeof (unsigned int) +
+            header->alias_count * sizeof (struct image_alias);
+    if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION ||
+            header->size != (unsigned int)s.st_size || sizeof *header + tables_size > header->size) {
+        munmap(base, s.st_size);
+        return 0;
+    }
+
+    struct image_file *files = (struct image_file *)(header + 1);
+    unsigned int *env = (unsigned int *)(files + header->file_count);
+    struct image_alias *aliases = (struct image_alias *)(env + header->env_count);
+
+    // Every string must lie in the strings area and end inside the file.
+    size_t strings_offset = sizeof *header + tables_size;
+    int valid = 1;
+    for (unsigned int i = 0; i < header->file_count && valid; i++) {
+        valid = image_string(base, strings_offset, header->size, files[i].path);
+    }
+    for (unsigned int i = 0; i < header->env_count && valid; i++) {
+        valid = image_string(base, strings_offset, header->size, env[i]);
+    }
+    for (unsigned int i = 0; i < header->alias_count && valid; i++) {
+        valid = image_string(base, strings_offset, header->size, aliases[i].name) &&
+                image_string(base, strings_offset, header->size, aliases[i].value);
+    }
+    if (!valid) {
+        munmap(base, s.st_size);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < header->file_count; i++) {
+        if (hash_file(base + files[i].path) != files[i].hash) {
+            munmap(base, s.st_size);
+            return 0;
+        }
+    }
+
+    // The mapping is never unmapped, so putenv can use the strings in place.
+    for (unsigned int i = 0; i < header->env_count; i++) {
+        putenv(base + env[i]);
+    }
+    for (unsigned int i = 0; i < header->alias_count; i++) {
+        alias_set(base + aliases[i].name, base + aliases[i].value);
+    }
+    return 1;
+}
+
+// True if offset is a string in the image's strings area, from strings_offset to size.
+int image_string(char *base, size_t strings_offset, size_t size, unsigned int offset) {
+    return offset >= strings_offset && offset < size && memchr(base + offset, '\0', size - offset) != NULL;
+}
+
+// Writes the current aliases, changed variables and sourced files to an image.
+int image_save(char *image_path, char **old_environment) {
+    extern char **environ;
+
+    // Only keep variables that were added or changed.
+    int env_count = 0;
+    char **env = malloc(sizeof (char *) * (words_length(environ) + 1));
+    for (int i = 0; environ[i] != NULL; i++) {
+        int j = 0;
+        while (old_environment[j] != NULL && strcmp(old_environment[j], environ[i]) != 0) {
+            j++;
+        }
+        if (old_environment[j] == NULL) {
+            env[env_count++] = environ[i];
+        }
+    }
+
+    int alias_count = 0;
+    size_t strings_size = 0;
+    for (int i = 0; i < ALIAS_TABLE_SIZE; i++) {
+        for (struct alias *a = ctx->alias_table[i]; a != NULL; a = a->next) {
+            strings_size += strlen(a->name) + strlen(a->value) + 2;
+            alias_count++;
+        }
+    }
+    for (int i = 0; i < env_count; i++) {
+        strings_size += strlen(env[i]) + 1;
+    }
+    for (int i = 0; i < image_source_count; i++) {
+        strings_size += strlen(image_sources[i]) + 1;
+    }
+
+    size_t files_offset = sizeof (struct image_header);
+    size_t env_offset = files_offset + image_source_count * sizeof (struct image_file);
+    size_t aliases_offset = env_offset + env_count * sizeof (unsigned int);
+    size_t used = aliases_offset + alias_count * sizeof (struct image_alias);
+    size_t size = used + strings_size;
+
+    char *buffer = calloc(1, size);
+    struct image_header *header = (struct image_header *)buffer;
+    struct image_file *files = (struct image_file *)(buffer + files_offset);
+    unsigned int *env_table = (unsigned int *)(buffer + env_offset);
+    struct image_alias *aliases = (struct image_alias *)(buffer + aliases_offset);
+
+    for (int i = 0; i < image_source_count; i++) {
+        files[i].path = used;
+        files[i].hash = hash_file(image_sources[i]);
+        strcpy(buffer + used, image_sources[i]);
+        used += strlen(image_sources[i]) + 1;
+    }
+    for (int i = 0; i < env_count; i++) {
+        env_table[i] = used;
+        strcpy(buffer + used, env[i]);
+        used += strlen(env[i]) + 1;
+    }
+    int n = 0;
+    for (int i = 0; i < ALIAS_TABLE_SIZE; i++) {
+        for (struct alias *a = ctx->alias_table[i]; a != NULL; a = a->next) {
+            aliases[n].name = used;
+            strcpy(buffer + used, a->name);
+            used += strlen(a->name) + 1;
+            aliases[n].value = used;
+            strcpy(buffer + used, a->value);
+            used += strlen(a->value) + 1;
+            n++;
+        }
+    }
+
+    header->magic = IMAGE_MAGIC;
+    header->version = IMAGE_VERSION;
+    header->size = size;
+    header->file_count = image_source_count;
+    header->env_count = env_count;
+    header->alias_count = alias_count;
+
+    FILE *fp = fopen(image_path, "w");
+    int written = 0;
+    if (fp != NULL) {
+        written = fwrite(buffer, 1, size, fp) == size;
+        written = (fclose(fp) == 0) && written;
+    }
+    free(buffer);
+    free(env);
+    return written;
+}
+
+// FNV-1a hash of a file's contents, a missing file hashes to 0.
+unsigned long hash_file(char *file_path) {
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    unsigned long hash = 14695981039346656037UL;
+    int ch;
+    while ((ch = getc(fp)) != EOF) {
+        hash = (hash ^ (unsigned char)ch) * 1099511628211UL;
+    }
+    fclose(fp);
+    return hash;
+}
+
+// Stores given command to ~/.jshell_history file.
+void store_command (char **words) {
+    if (!ctx->record_history) {
+        return;
+    }
+
+    // Need to get full path of home directory.
+    char *file_path = get_file_in_home(".jshell_history");
+
+    // Now just open and append command with newline at the end.
+    FILE *fp = fopen(file_path, "a");
+    if (fp == NULL) {
+        free(file_path);
+        return;
+    }
+    char **start = words;
+    long bytes = 1;
+    while (*words != NULL) {
+        bytes += strlen(*words) + 1;
+        fputs(*words++, fp);
+        fputc(' ', fp);
+    }
+    fputc('\n', fp);
+    fclose(fp);
+    metrics_add(JSH_HISTORY_BYTES, bytes);
+    free(file_path);
+
+    // The log entry is written by run_line once the command has finished.
+    free(ctx->logged_command);
+    free(ctx->logged_cwd);
+    ctx->logged_command = join_words(start);
+    ctx->logged_cwd = getcwd(NULL, 0);
+    clock_gettime(CLOCK_REALTIME, &ctx->logged_start);
+
+    // Keep the copy in memory the same as the file, once there is one.
+    pthread_mutex_lock(&history_lock);
+    if (history_loaded) {
+        char *line = join_words(start);
+        history_add(line);
+    }
+    pthread_mutex_unlock(&history_lock);
+}
+
+// Reads the history file into memory and indexes it, history_lock must be held.
+void history_load(void) {
+    history_loaded = 1;
+    char *file_path = get_file_in_home(".jshell_history");
+    FILE *fp = fopen(file_path, "r");
+    free(file_path);
+    if (fp == NULL) {
+        return;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, fp)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == ' ')) {
+            line[--length] = '\0';
+        }
+        history_add(strdup(line));
+    }
+    free(line);
+    fclose(fp);
+}
+
+// Appends a command, which history now owns, and indexes its first characters.
+void history_add(char *line) {
+    if (history_count == history_capacity) {
+        history_capacity = history_capacity ? history_capacity * 2 : 1024;
+        history_lines = realloc(history_lines, sizeof (char *) * history_capacity);
+    }
+    size_t index = history_count++;
+    history_lines[index] = line;
+
+    struct history_node *node = &history_root;
+    node->newest = index;
+    for (int depth = 0; depth < HISTORY_TRIE_DEPTH && line[depth] != '\0'; depth++) {
+        unsigned char key = line[depth];
+        struct history_node *child = node->child;
+        while (child != NULL && child->key != key) {
+            child = child->sibling;
+        }
+        if (child == NULL) {
+            child = calloc(1, sizeof *child);
+            child->key = key;
+            child->sibling = node->child;
+            node->child = child;
+        }
+        child->newest = index;
+        node = child;
+    }
+}
+
+//
+// Index of the newest command starting with prefix, or -1.
+// The trie answers prefixes up to HISTORY_TRIE_DEPTH characters at once,
+// longer ones are checked against older commands from that point back.
+//
+long history_prefix(char *prefix) {
+    size_t length = strlen(prefix);
+    struct history_node *node = &history_root;
+    for (size_t depth = 0; depth < length && depth < HISTORY_TRIE_DEPTH; depth++) {
+        struct history_node *child = node->child;
+        while (child != NULL && child->key != (unsigned char)prefix[depth]) {
+            child = child->sibling;
+        }
+        if (child == NULL) {
+            return -1;
+        }
+        node = child;
+    }
+    if (history_count == 0) {
+        return -1;
+    }
+    for (long i = node->newest; i >= 0; i--) {
+        if (strncmp(history_lines[i], prefix, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Works out the command a ! line refers to, plus any words after it.
+//
+//  * !  !!          the last command
+//  * ! n            command n, as numbered by history
+//  * !-n            the command n back
+//  * !prefix        the newest command starting with prefix
+//  * !?str?         the newest command containing str
+//
+// !! !$ and !* have already been replaced by history_expand_words.
+// Returns a malloc'd line, or NULL after printing an error.
+//
+char *history_resolve(char **words) {
+    pthread_mutex_lock(&history_lock);
+    if (!history_loaded) {
+        history_load();
+    }
+
+    char *designator = (words[1] == NULL) ? "!" : words[1];
+    long index = -1;
+    char *end;
+    if (strcmp(designator, "!") == 0) {
+        index = (long)history_count - 1;
+    } else if (designator[0] == '?') {
+        size_t length = strlen(designator + 1);
+        char *needle = strndup(designator + 1, (length && designator[length] == '?') ? length - 1 : length);
+        for (long i = (long)history_count - 1; i >= 0 && index == -1; i--) {
+            if (strstr(history_lines[i], needle) != NULL) {
+                index = i;
+            }
+        }
+        free(needle);
+    } else if ((designator[0] == '-' && isdigit((unsigned char)designator[1])) ||
+            isdigit((unsigned char)designator[0])) {
+        long n = strtol(designator, &end, 10);
+        if (*end == '\0') {
+            index = (n < 0) ? (long)history_count + n : n;
+            if (index < 0 || index >= (long)history_count) {
+                index = -1;
+            }
+        } else {
+            index = history_prefix(designator);
+        }
+    } else {
+        index = history_prefix(designator);
+    }
+
+    char *line = (index != -1) ? strdup(history_lines[index]) : NULL;
+    pthread_mutex_unlock(&history_lock);
+
+    if (line == NULL) {
+        fprintf(stderr, "!%s: event not found\n", designator);
+        ctx->last_status = 1;
+        return NULL;
+    }
+
+    // Words after the designator are added to the end, as in !ls -l.
+    if (words[1] != NULL && words[2] != NULL) {
+        char *extra = join_words(words + 2);
+        char *joined = malloc(strlen(line) + strlen(extra) + 2);
+        sprintf(joined, "%s%s%s", line, *line ? " " : "", extra);
+        free(line);
+        free(extra);
+        line = joined;
+    }
+    return line;
+}
+
+//
+// Replaces !! !$ and !* wherever they are in a line with the last command,
+// its last word or its arguments, and prints the line if anything changed.
+// The words array is freed and a new one returned, to be freed with
+// free_tokens, or NULL after printing an error.
+// eg. after "echo hello world", {"vim", "!", "$", NULL} becomes {"vim", "world", NULL}
+//
+char **history_expand_words(char **words) {
+    int found = -1;
+    int length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (found == -1 && history_designator(words, i)) {
+            found = i;
+        }
+        length++;
+    }
+    if (found == -1) {
+        return words;
+    }
+
+    pthread_mutex_lock(&history_lock);
+    if (!history_loaded) {
+        history_load();
+    }
+    char *last = history_count ? strdup(history_lines[history_count - 1]) : NULL;
+    pthread_mutex_unlock(&history_lock);
+    if (last == NULL) {
+        fprintf(stderr, "!%s: event not found\n", words[found + 1]);
+        ctx->last_status = 1;
+        free_tokens(words);
+        return NULL;
+    }
+
+    // tokenize splits the designators in two, as it does the last command's words.
+    char **last_words = tokenize(last, WORD_SEPARATORS, SPECIAL_CHARS);
+    int last_length = words_length(last_words);
+    char **new_words = malloc(sizeof (char *) * (length * (last_length + 1) + 1));
+    int n = 0;
+    for (int i = 0; i < length; i++) {
+        if (!history_designator(words, i)) {
+            new_words[n++] = words[i];
+            continue;
+        }
+        char kind = words[i + 1][0];
+        int from = (kind == '$') ? last_length - 1 : (kind == '*') ? 1 : 0;
+        for (int j = (from < 0) ? 0 : from; j < last_length; j++) {
+            new_words[n++] = strdup(last_words[j]);
+        }
+        free(words[i]);
+        free(words[i + 1]);
+        i++;
+    }
+    new_words[n] = NULL;
+    free(words);
+    free_tokens(last_words);
+    free(last);
+
+    char *line = join_words(new_words);
+    printf("%s\n", line);
+    free(line);
+    return new_words;
+}
+
+// True if words[i] and words[i + 1] are the two halves of !! !$ or !*.
+int history_designator(char **words, int i) {
+    return strcmp(words[i], "!") == 0 && words[i + 1] != NULL && (strcmp(words[i + 1], "!") == 0 ||
+            strcmp(words[i + 1], "$") == 0 || strcmp(words[i + 1], "*") == 0);
+}
+
+// ^old^new runs the last command with the first old replaced by new.
+char *history_substitute(char **words) {
+    char *text = join_words(words);
+    char *old = text + 1;
+    char *new = strchr(old, '^');
+    if (new == NULL || new == old) {
+        fprintf(stderr, "%s: bad substitution\n", text);
+        free(text);
+        ctx->last_status = 1;
+        return NULL;
+    }
+    *new++ = '\0';
+    char *end = strchr(new, '^');
+    if (end != NULL) {
+        *end = '\0';
+    }
+
+    char *last = NULL;
+    pthread_mutex_lock(&history_lock);
+    if (!history_loaded) {
+        history_load();
+    }
+    if (history_count > 0) {
+        last = strdup(history_lines[history_count - 1]);
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    char *match = (last == NULL) ? NULL : strstr(last, old);
+    if (match == NULL) {
+        fprintf(stderr, "^%s: substitution failed\n", old);
+        free(last);
+        free(text);
+        ctx->last_status = 1;
+        return NULL;
+    }
+    size_t old_length = strlen(old);
+    char *line = malloc(strlen(last) - old_length + strlen(new) + 1);
+    sprintf(line, "%.*s%s%s", (int)(match - last), last, new, match + old_length);
+    free(last);
+    free(text);
+    return line;
+}
+
+//
+// Appends the command store_command() recorded to ~/.jshell_history.log:
+// start time, seconds taken, exit status, directory and the command, tab separated.
+//
+void history_log(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double start = ctx->logged_start.tv_sec + ctx->logged_start.tv_nsec / 1e9;
+    double duration = (now.tv_sec - ctx->logged_start.tv_sec) +
+            (now.tv_nsec - ctx->logged_start.tv_nsec) / 1e9;
+
+    // One write per entry so sessions sharing the log don't interleave.
+    char *entry;
+    int length = asprintf(&entry, "%.3f\t%.6f\t%d\t%s\t%s\n", start, duration, ctx->last_status,
+            ctx->logged_cwd != NULL ? ctx->logged_cwd : "", ctx->logged_command);
+    char *file_path = get_file_in_home(HISTORY_LOG);
+    int fd = open(file_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd != -1 && length > 0) {
+        write_all(fd, entry, length);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (length > 0) {
+        free(entry);
+    }
+    free(file_path);
+    free(ctx->logged_command);
+    free(ctx->logged_cwd);
+    ctx->logged_command = NULL;
+    ctx->logged_cwd = NULL;
+}
+
+//
+// history --top [n]       programs that took the most wall time in total
+// history --slowest [n]   the n slowest commands
+// history --failed [n]    the last n commands that failed
+// history --since time    only commands since a date (YYYY-MM-DD), epoch
+//                         seconds, or a time ago such as 30m, 12h or 7d
+// history --cwd dir       only commands run in dir or below it
+//
+// --since and --cwd can be added to any of the others, on their own they
+// list the matching commands.
+//
+void history_query(char **words) {
+    struct history_scan query;
+    memset(&query, 0, sizeof query);
+    char *view = NULL;
+    char *cwd = NULL;
+    size_t limit = DEFAULT_HISTORY_SHOWN;
+    for (int i = 1; words[i] != NULL; i++) {
+        if (strcmp(words[i], "--top") == 0 || strcmp(words[i], "--slowest") == 0 ||
+                strcmp(words[i], "--failed") == 0) {
+            if (strcmp(words[i], "--failed") == 0) {
+                query.failed = 1;
+            } else {
+                view = words[i];
+            }
+            if (words[i + 1] != NULL && isdigit((unsigned char)words[i + 1][0])) {
+                limit = strtoul(words[++i], NULL, 10);
+            }
+        } else if (strcmp(words[i], "--since") == 0 && words[i + 1] != NULL) {
+            if (!history_parse_since(words[++i], &query.since)) {
+                fprintf(stderr, "history: %s: bad time\n", words[i]);
+                ctx->last_status = 2;
+                return;
+            }
+        } else if (strcmp(words[i], "--cwd") == 0 && words[i + 1] != NULL) {
+            cwd = words[++i];
+        } else {
+            fprintf(stderr, "history: %s: bad option\n", words[i]);
+            ctx->last_status = 2;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&history_lock);
+    struct history_table *table = &history_table;
+    if (!history_table_update(table)) {
+        pthread_mutex_unlock(&history_lock);
+        ctx->last_status = 1;
+        return;
+    }
+
+    // The directory test is done once per distinct directory, not per row.
+    query.table = table;
+    if (cwd != NULL) {
+        char *resolved = realpath(cwd, NULL);
+        char *dir = resolved != NULL ? resolved : cwd;
+        size_t dir_length = strlen(dir);
+        while (dir_length > 1 && dir[dir_length - 1] == '/') {
+            dir_length--;
+        }
+        query.cwd_match = calloc(table->name_count + 1, 1);
+        for (unsigned int n = 0; n < table->name_count; n++) {
+            char *name = table->names[n];
+            query.cwd_match[n] = strncmp(name, dir, dir_length) == 0 &&
+                    (name[dir_length] == '\0' || name[dir_length] == '/' || dir_length == 1);
+        }
+        free(resolved);
+    }
+    query.limit = limit;
+    query.match = malloc(table->rows + 1);
+
+    // Split the rows between threads, each scans its own segment.
+    int segments = (table->rows < HISTORY_SEGMENT_MIN) ? 1 : thread_count(HISTORY_MAX_THREADS);
+    struct history_scan scans[HISTORY_MAX_THREADS];
+    pthread_t threads[HISTORY_MAX_THREADS];
+    int started[HISTORY_MAX_THREADS] = {0};
+    for (int t = 0; t < segments; t++) {
+        scans[t] = query;
+        scans[t].begin = table->rows * t / segments;
+        scans[t].end = table->rows * (t + 1) / segments;
+        scans[t].program_time = (view != NULL && view[2] == 't') ? calloc(table->name_count + 1, sizeof (double)) : NULL;
+        scans[t].program_runs = (view != NULL && view[2] == 't') ? calloc(table->name_count + 1, sizeof (size_t)) : NULL;
+        scans[t].slowest = (view != NULL && view[2] == 's') ? malloc(sizeof (size_t) * (limit + 1)) : NULL;
+        if (t > 0) {
+            started[t] = pthread_create(&threads[t], NULL, history_scan_segment, &scans[t]) == 0;
+        }
+        if (t > 0 && !started[t]) {
+            history_scan_segment(&scans[t]);
+        }
+    }
+    history_scan_segment(&scans[0]);
+    for (int t = 1; t < segments; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    if (view != NULL && view[2] == 't') {
+        // Add up the segments, then pick the programs with the most time.
+        for (int t = 1; t < segments; t++) {
+            for (unsigned int n = 0; n < table->name_count; n++) {
+                scans[0].program_time[n] += scans[t].program_time[n];
+                scans[0].program_runs[n] += scans[t].program_runs[n];
+            }
+        }
+        for (size_t shown = 0; shown < limit; shown++) {
+            long best = -1;
+            for (unsigned int n = 0; n < table->name_count; n++) {
+                if (scans[0].program_runs[n] > 0 && (best == -1 || scans[0].program_time[n] > scans[0].program_time[best])) {
+                    best = n;
+                }
+            }
+            if (best == -1) {
+                break;
+            }
+            printf("%12.3fs %8zu  %s\n", scans[0].program_time[best], scans[0].program_runs[best], table->names[best]);
+            scans[0].program_runs[best] = 0;
+        }
+    } else if (view != NULL) {
+        // Each segment kept its slowest rows, the slowest of those are shown.
+        for (size_t shown = 0; shown < limit; shown++) {
+            int best = -1;
+            for (int t = 0; t < segments; t++) {
+                if (scans[t].slowest_count > 0 && (best == -1 ||
+                        table->duration[scans[t].slowest[0]] > table->duration[scans[best].slowest[0]])) {
+                    best = t;
+                }
+            }
+            if (best == -1) {
+                break;
+            }
+            history_print_row(table, scans[best].slowest[0]);
+            scans[best].slowest_count--;
+            memmove(scans[best].slowest, scans[best].slowest + 1, sizeof (size_t) * scans[best].slowest_count);
+        }
+    } else {
+        // Without a view the newest matches are listed, oldest first.
+        size_t first = table->rows;
+        size_t found = 0;
+        while (first > 0 && found < limit) {
+            if (query.match[--first]) {
+                found++;
+            }
+        }
+        for (size_t row = first; row < table->rows; row++) {
+            if (query.match[row]) {
+                history_print_row(table, row);
+            }
+        }
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    for (int t = 0; t < segments; t++) {
+        free(scans[t].program_time);
+        free(scans[t].program_runs);
+        free(scans[t].slowest);
+    }
+    free(query.cwd_match);
+    free(query.match);
+    ctx->last_status = 0;
+}
+
+// Applies the filters to a segment of rows and works out its part of the view.
+void *history_scan_segment(void *arg) {
+    struct history_scan *scan = arg;
+    struct history_table *table = scan->table;
+    for (size_t row = scan->begin; row < scan->end; row++) {
+        int match = table->start[row] >= scan->since &&
+                (!scan->failed || table->status[row] != 0) &&
+                (scan->cwd_match == NULL || scan->cwd_match[table->cwd[row]]);
+        scan->match[row] = match;
+        if (!match) {
+            continue;
+        }
+        if (scan->program_time != NULL) {
+            scan->program_time[table->program[row]] += table->duration[row];
+            scan->program_runs[table->program[row]]++;
+        }
+        if (scan->slowest != NULL && scan->limit > 0) {
+            // Kept slowest first, a new row is put in order if it makes the cut.
+            size_t i = scan->slowest_count;
+            if (i == scan->limit) {
+                if (table->duration[row] <= table->duration[scan->slowest[i - 1]]) {
+                    continue;
+                }
+                i--;
+            } else {
+                scan->slowest_count++;
+            }
+            while (i > 0 && table->duration[scan->slowest[i - 1]] < table->duration[row]) {
+                scan->slowest[i] = scan->slowest[i - 1];
+                i--;
+            }
+            scan->slowest[i] = row;
+        }
+    }
+    return NULL;
+}
+
+// Reads whatever has been added to the log since the last call, history_lock must be held.
+int history_table_update(struct history_table *table) {
+    char *file_path = get_file_in_home(HISTORY_LOG);
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    free(file_path);
+    if (fd == -1) {
+        return errno == ENOENT;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    // The log is only ever appended to, unless someone starts it again.
+    if (st.st_size < table->log_size) {
+        table->rows = 0;
+        table->text_used = 0;
+        table->log_size = 0;
+    }
+    size_t added = st.st_size - table->log_size;
+    if (added == 0) {
+        close(fd);
+        return 1;
+    }
+    if (table->text_used + added + 1 > table->text_size) {
+        table->text_size = (table->text_used + added + 1) * 2;
+        table->text = realloc(table->text, table->text_size);
+    }
+    char *data = table->text + table->text_used;
+    size_t got = 0;
+    while (got < added) {
+        ssize_t n = pread(fd, data + got, added - got, table->log_size + got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+
+    // Only whole lines are taken, a half written entry is read next time.
+    size_t used = 0;
+    while (used < got) {
+        char *line = data + used;
+        char *newline = memchr(line, '\n', got - used);
+        if (newline == NULL) {
+            break;
+        }
+        *newline = '\0';
+        used = newline - data + 1;
+
+        char *fields[5];
+        int field_count = 0;
+        fields[field_count++] = line;
+        for (char *p = line; *p != '\0' && field_count < 5; p++) {
+            if (*p == '\t') {
+                *p = '\0';
+                fields[field_count++] = p + 1;
+            }
+        }
+        if (field_count < 5) {
+            continue;
+        }
+
+        if (table->rows == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 1024;
+            table->start = realloc(table->start, sizeof (double) * table->capacity);
+            table->duration = realloc(table->duration, sizeof (double) * table->capacity);
+            table->status = realloc(table->status, sizeof (int) * table->capacity);
+            table->program = realloc(table->program, sizeof (unsigned int) * table->capacity);
+            table->cwd = realloc(table->cwd, sizeof (unsigned int) * table->capacity);
+            table->command = realloc(table->command, sizeof (size_t) * table->capacity);
+        }
+        size_t row = table->rows++;
+        table->start[row] = strtod(fields[0], NULL);
+        table->duration[row] = strtod(fields[1], NULL);
+        table->status[row] = atoi(fields[2]);
+        table->cwd[row] = history_intern(table, fields[3]);
+        table->command[row] = fields[4] - table->text;
+
+        // The program is the first word, or the third after < file.
+        char *program = fields[4];
+        if (program[0] == '<' && program[1] == ' ') {
+            char *file_end = strchr(program + 2, ' ');
+            program = (file_end != NULL) ? file_end + 1 : program;
+        }
+        size_t program_length = strcspn(program, " ");
+        char saved = program[program_length];
+        program[program_length] = '\0';
+        table->program[row] = history_intern(table, program);
+        program[program_length] = saved;
+    }
+    table->text_used += used;
+    table->log_size += used;
+    return 1;
+}
+
+// Number for a program or directory name, each distinct name is stored once.
+unsigned int history_intern(struct history_table *table, char *name) {
+    if ((table->name_count + 1) * 2 > table->slot_count) {
+        unsigned int slot_count = table->slot_count ? table->slot_count * 2 : 256;
+        unsigned int *slots = malloc(sizeof (unsigned int) * slot_count);
+        for (unsigned int i = 0; i < slot_count; i++) {
+            slots[i] = UINT_MAX;
+        }
+        for (unsigned int n = 0; n < table->name_count; n++) {
+            unsigned int i = hash_string(table->names[n]) & (slot_count - 1);
+            while (slots[i] != UINT_MAX) {
+                i = (i + 1) & (slot_count - 1);
+            }
+            slots[i] = n;
+        }
+        free(table->name_slots);
+        table->name_slots = slots;
+        table->slot_count = slot_count;
+        table->names = realloc(table->names, sizeof (char *) * (slot_count / 2));
+    }
+    unsigned int i = hash_string(name) & (table->slot_count - 1);
+    while (table->name_slots[i] != UINT_MAX) {
+        if (strcmp(table->names[table->name_slots[i]], name) == 0) {
+            return table->name_slots[i];
+        }
+        i = (i + 1) & (table->slot_count - 1);
+    }
+    table->names[table->name_count] = strdup(name);
+    table->name_slots[i] = table->name_count;
+    return table->name_count++;
+}
+
+// Accepts YYYY-MM-DD, epoch seconds, or a number of s, m, h or d ago.
+int history_parse_since(char *text, double *since) {
+    struct tm date;
+    memset(&date, 0, sizeof date);
+    char *end = strptime(text, "%Y-%m-%d", &date);
+    if (end != NULL && *end == '\0') {
+        date.tm_isdst = -1;
+        *since = mktime(&date);
+        return 1;
+    }
+    double number = strtod(text, &end);
+    if (end == text) {
+        return 0;
+    }
+    char *units = "smhd";
+    double seconds[] = {1, 60, 3600, 86400};
+    if (*end == '\0') {
+        *since = number;
+        return 1;
+    }
+    char *unit = strchr(units, *end);
+    if (unit == NULL || end[1] != '\0') {
+        return 0;
+    }
+    *since = time(NULL) - number * seconds[unit - units];
+    return 1;
+}
+
+// Prints one entry: when it started, how long it took, its status and the command.
+void history_print_row(struct history_table *table, size_t row) {
+    char when[32];
+    time_t start = (time_t)table->start[row];
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("%s %10.3fs %3d  %s\n", when, table->duration[row], table->status[row],
+            table->text + table->command[row]);
+}
+
+// Prints and runs a command found in the history, NULL is a lookup that failed.
+void run_history(char *line, char **path, char **environment) {
+    if (line == NULL) {
+        return;
+    }
+    printf("%s\n", line);
+    run_line(line, path, environment);
+    free(line);
+}
+
+//
+// Does operations on last n commands depending on given mode.
+// If mode is EXECUTE, the nth command will be printed then executed.
+// If mode is PRINT, the last nth commands will be printed.
+//
+void last_n_commands(int number, int mode, char **environ, char **path) {
+    char *file_path = get_file_in_home(".jshell_history");
+    char line[MAX_LINE_CHARS]; 
+    int line_number = 0;
+
+    // Open file and move to avoid newline at the end.
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        free(file_path);
+        return;
+    }
+
+    // Count number of lines first.
+    int total_lines = line_count_file(fp);
+    if (number == -1) {
+        number = total_lines - 1;
+    }
+
+    int start_line = total_lines - number; 
+    if (start_line < 0) {
+        start_line = 0;
+    }
+    fseek(fp, 0, SEEK_SET);
+
+    // Loop through lines. 
+    while (line_number < total_lines) {
+        fgets(line, MAX_LINE_CHARS, fp);
+            if (mode == PRINT && line_number >= start_line) { 
+                printf("%d: %s", line_number, line);
+            } else if (mode == EXECUTE && line_number == number) {
+                printf("%s", line);
+                run_line(line, path, environ);
+                return;
+            }
+        line_number++;
+    }
+    fclose(fp);
+    free(file_path);
+}
+
+// Prints last int(words[1]) commands.
+void print_history(char **words){
+    int length = words_length(words);
+    if (words[1] != NULL && strncmp(words[1], "--", 2) == 0) {
+        history_query(words);
+        return;
+    }
+    // Either print specified amount of the default (10).
+    if (words[1] != NULL) {
+        int number;
+        if (sscanf(words[1], "%d", &number) == 0) {
+            fprintf(stderr, "history: %s: numeric argument required\n", words[1]);
+            store_command(words);
+            return;
+        } else if (length > 2) {
+            fprintf(stderr, "history: too many arguments\n");
+            store_command(words);
+            return;
+        }
+        last_n_commands(number, PRINT, NULL, NULL);
+    } else {
+        last_n_commands(10, PRINT, NULL, NULL);
+    }
+}
+
+//
+// Given an array of strings this will add globbed words to it.
+// flags holds classify_word() for each word, only real wildcards are globbed
+// and a plain ~ or ~/ prefix is replaced without calling glob at all.
+// The paths go into pool, which the caller frees once the command is done.
+//
+char **glob_words(char **words, int *flags, struct glob_pool *pool) {
+    int length = words_length(words);
+    size_t *starts = malloc(sizeof (size_t) * (length + 1));
+    size_t *counts = calloc(length + 1, sizeof (size_t));
+    int patterns = 0;
+
+    // Match every pattern first, the pool moves as it grows.
+    for (int i = 1; i < length; i++) {
+        if ((flags[i] & (WORD_WILDCARD | WORD_TILDE)) == WORD_TILDE) {
+            char *expanded = expand_tilde(words[i]);
+            if (expanded != NULL) {
+                words[i] = expanded;
+                continue;
+            }
+        } else if (!(flags[i] & WORD_WILDCARD)) {
+            continue;
+        }
+
+        starts[i] = pool->count;
+        patterns++;
+        glob_pattern(words[i], pool);
+        metrics_add(JSH_GLOB_CALLS, 1);
+        metrics_add(JSH_GLOB_PATHS, pool->count - starts[i]);
+
+        // No match leaves the pattern as it is.
+        if (pool->count == starts[i]) {
+            glob_pool_add(pool, "", 0, words[i]);
+        } else if (!ctx->nosortglob) {
+            glob_sort(pool->offsets + starts[i], pool->count - starts[i], pool->strings);
+        }
+        counts[i] = pool->count - starts[i];
+    }
+
+    if (patterns == 0) {
+        free(starts);
+        free(counts);
+        return words;
+    }
+
+    // Now the pool is final the words can point into it.
+    pool->words = malloc(sizeof (char *) * (length - patterns + pool->count + 1));
+    int n = 0;
+    pool->words[n++] = words[0];
+    for (int i = 1; i < length; i++) {
+        if (counts[i] == 0) {
+            pool->words[n++] = words[i];
+            continue;
+        }
+        for (size_t p = starts[i]; p < starts[i] + counts[i]; p++) {
+            pool->words[n++] = pool->strings + pool->offsets[p];
+        }
+    }
+    pool->words[n] = NULL;
+    free(starts);
+    free(counts);
+    return pool->words;
+}
+
+//
+// Adds the paths matching pattern to the pool, unsorted.
+// When the wildcards are all in the last component that one directory is
+// read directly, anything else is left to glob().
+//
+void glob_pattern(char *pattern, struct glob_pool *pool) {
+    char *slash = strrchr(pattern, '/');
+    char *name = (slash == NULL) ? pattern : slash + 1;
+    size_t prefix_length = name - pattern;
+    if (pattern[0] != '~' && *name != '\0' && strcspn(pattern, "*?[\\") >= prefix_length) {
+        char *directory = (slash == NULL) ? strdup(".") :
+                strndup(pattern, (slash == pattern) ? 1 : prefix_length - 1);
+        int fd = openat(cwd_dir(), directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        free(directory);
+        DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+        if (dir == NULL) {
+            if (fd != -1) {
+                close(fd);
+            }
+            return;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (fnmatch(name, entry->d_name, FNM_PERIOD) == 0) {
+                glob_pool_add(pool, pattern, prefix_length, entry->d_name);
+            }
+        }
+        closedir(dir);
+        return;
+    }
+
+    glob_t results;
+    if (glob(pattern, GLOB_TILDE|GLOB_NOSORT, NULL, &results) == 0) {
+        for (size_t i = 0; i < results.gl_pathc; i++) {
+            glob_pool_add(pool, "", 0, results.gl_pathv[i]);
+        }
+    }
+    globfree(&results);
+}
+
+// Appends prefix (only its first prefix_length bytes) and name as one path.
+void glob_pool_add(struct glob_pool *pool, char *prefix, size_t prefix_length, char *name) {
+    size_t name_length = strlen(name);
+    size_t needed = prefix_length + name_length + 1;
+    if (pool->used + needed > pool->size) {
+        pool->size = (pool->used + needed) * 2;
+        pool->strings = realloc(pool->strings, pool->size);
+    }
+    if (pool->count == pool->capacity) {
+        pool->capacity = pool->capacity ? pool->capacity * 2 : 64;
+        pool->offsets = realloc(pool->offsets, sizeof (size_t) * pool->capacity);
+    }
+    pool->offsets[pool->count++] = pool->used;
+    memcpy(pool->strings + pool->used, prefix, prefix_length);
+    memcpy(pool->strings + pool->used + prefix_length, name, name_length + 1);
+    pool->used += needed;
+}
+
+void glob_pool_free(struct glob_pool *pool) {
+    free(pool->strings);
+    free(pool->offsets);
+    free(pool->words);
+}
+
+//
+// Sorts paths by their bytes, which is what glob's strcoll gives as the
+// shell never leaves the C locale.
+// Large lists are split on their first byte and the buckets shared out
+// between threads.
+//
+void glob_sort(size_t *offsets, size_t count, char *strings) {
+    size_t *scratch = malloc(sizeof (size_t) * count);
+    if (count < GLOB_PARALLEL_MIN) {
+        radix_sort(offsets, scratch, count, strings, 0);
+        free(scratch);
+        return;
+    }
+
+    struct glob_sort_job job = {offsets, scratch, strings, {0}, 1};
+    for (size_t i = 0; i < count; i++) {
+        job.starts[(unsigned char)strings[offsets[i]] + 1]++;
+    }
+    for (int b = 1; b <= 256; b++) {
+        job.starts[b] += job.starts[b - 1];
+    }
+    size_t next[256];
+    memcpy(next, job.starts, sizeof next);
+    for (size_t i = 0; i < count; i++) {
+        scratch[next[(unsigned char)strings[offsets[i]]]++] = offsets[i];
+    }
+    memcpy(offsets, scratch, sizeof (size_t) * count);
+
+    int threads_wanted = thread_count(GLOB_MAX_THREADS);
+    pthread_t threads[GLOB_MAX_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads_wanted; t++) {
+        if (pthread_create(&threads[started], NULL, glob_sort_worker, &job) == 0) {
+            started++;
+        }
+    }
+    glob_sort_worker(&job);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(scratch);
+}
+
+// Takes first-byte buckets until none are left, bucket 0 is the empty paths.
+void *glob_sort_worker(void *arg) {
+    struct glob_sort_job *job = arg;
+    int b;
+    while ((b = __atomic_fetch_add(&job->next_bucket, 1, __ATOMIC_RELAXED)) < 256) {
+        size_t start = job->starts[b];
+        radix_sort(job->offsets + start, job->scratch + start, job->starts[b + 1] - start, job->strings, 1);
+    }
+    return NULL;
+}
+
+//
+// MSD radix sort on the byte at depth, all paths given share the bytes before it.
+// Paths with a long shared prefix are left to qsort past GLOB_RADIX_DEPTH,
+// so the recursion stays shallow.
+//
+void radix_sort(size_t *offsets, size_t *scratch, size_t count, char *strings, size_t depth) {
+    if (depth >= GLOB_RADIX_DEPTH && count >= GLOB_INSERTION_MAX) {
+        char *base = strings + depth;
+        qsort_r(offsets, count, sizeof (size_t), compare_glob_paths, base);
+        return;
+    }
+    if (count < GLOB_INSERTION_MAX) {
+        for (size_t i = 1; i < count; i++) {
+            size_t offset = offsets[i];
+            size_t j = i;
+            while (j > 0 && strcmp(strings + offsets[j - 1] + depth, strings + offset + depth) > 0) {
+                offsets[j] = offsets[j - 1];
+                j--;
+            }
+            offsets[j] = offset;
+        }
+        return;
+    }
+
+    size_t starts[257] = {0};
+    for (size_t i = 0; i < count; i++) {
+        starts[(unsigned char)strings[offsets[i] + depth] + 1]++;
+    }
+    for (int b = 1; b <= 256; b++) {
+        starts[b] += starts[b - 1];
+    }
+    size_t next[256];
+    memcpy(next, starts, sizeof next);
+    for (size_t i = 0; i < count; i++) {
+        scratch[next[(unsigned char)strings[offsets[i] + depth]]++] = offsets[i];
+    }
+    memcpy(offsets, scratch, sizeof (size_t) * count);
+
+    // Paths that ended at depth are equal, the rest go one byte deeper.
+    for (int b = 1; b < 256; b++) {
+        if (starts[b + 1] - starts[b] > 1) {
+            radix_sort(offsets + starts[b], scratch + starts[b], starts[b + 1] - starts[b], strings, depth + 1);
+        }
+    }
+}
+
+// Orders two glob offsets by their paths, arg is the strings past the shared prefix.
+int compare_glob_paths(const void *a, const void *b, void *arg) {
+    char *strings = arg;
+    return strcmp(strings + *(const size_t *)a, strings + *(const size_t *)b);
+}
+
+// Number of threads to use for parallel work, one per CPU up to max.
+int thread_count(int max) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus < 1) ? 1 : (cpus > max ? max : (int)cpus);
+}
+
+//
+// set -o name turns an option on, set +o name turns it off and
+// set -o on its own lists them. The options are nosortglob and pipemeter.
+//
+void set_option(char **words) {
+    if (words[1] != NULL && strcmp(words[1], "-o") == 0 && words[2] == NULL) {
+        printf("nosortglob\t%s\n", ctx->nosortglob ? "on" : "off");
+        printf("pipemeter\t%s\n", ctx->pipemeter ? "on" : "off");
+        ctx->last_status = 0;
+        return;
+    }
+    if (words[1] == NULL || words[2] == NULL || words[3] != NULL ||
+            (strcmp(words[1], "-o") != 0 && strcmp(words[1], "+o") != 0)) {
+        fprintf(stderr, "set: usage: set [-o|+o] option\n");
+        ctx->last_status = 2;
+        return;
+    }
+    int *flag = option_flag(words[2]);
+    if (flag == NULL) {
+        fprintf(stderr, "set: %s: invalid option name\n", words[2]);
+        ctx->last_status = 2;
+        return;
+    }
+    *flag = (words[1][0] == '-');
+    ctx->last_status = 0;
+}
+
+// Returns where the context keeps an option, NULL if there is no such option.
+int *option_flag(char *name) {
+    if (strcmp(name, "nosortglob") == 0) {
+        return &ctx->nosortglob;
+    } else if (strcmp(name, "pipemeter") == 0) {
+        return &ctx->pipemeter;
+    }
+    return NULL;
+}
+
+//
+// Says in one pass what a word needs: WORD_WILDCARD for * ? or [,
+// WORD_TILDE for a leading ~, WORD_VARIABLE for $ and WORD_ESCAPE for a
+// backslash before a special character or separator.
+// This runs on the words as executed rather than in tokenize, because alias
+// and parameter expansion put in words that tokenize never saw.
+//
+int classify_word(char *word) {
+    int flags = (word[0] == '~') ? WORD_TILDE : 0;
+    for (char *s = word; *s != '\0'; s++) {
+        switch (*s) {
+        case '*':
+        case '?':
+        case '[':
+            flags |= WORD_WILDCARD;
+            break;
+        case '$':
+            flags |= WORD_VARIABLE;
+            break;
+        case '\\':
+            if (s[1] != '\0' && strchr(SPECIAL_CHARS WORD_SEPARATORS, s[1]) != NULL) {
+                flags |= WORD_ESCAPE;
+                s++;
+            }
+            break;
+        }
+    }
+    return flags;
+}
+
+//
+// Expands ~ and ~/path from HOME, the result is allocated in the arena.
+// Returns NULL for ~user or when HOME is unset so glob can deal with it.
+//
+char *expand_tilde(char *word) {
+    if (word[1] != '\0' && word[1] != '/') {
+        return NULL;
+    }
+    if (ctx->home == NULL) {
+        char *home = getenv("HOME");
+        if (home == NULL) {
+            return NULL;
+        }
+        ctx->home = strdup(home);
+    }
+    size_t home_length = strlen(ctx->home);
+    size_t rest_length = strlen(word + 1);
+    char *expanded = arena_alloc(home_length + rest_length + 1);
+    memcpy(expanded, ctx->home, home_length);
+    memcpy(expanded + home_length, word + 1, rest_length + 1);
+    return expanded;
+}
+
+// Drops the cached HOME if the variable being set is HOME.
+void forget_home(char *name) {
+    if (strcmp(name, "HOME") == 0) {
+        free(ctx->home);
+        ctx->home = NULL;
+    }
+}
+
+//
+// Returns a new array with the parameters in each word expanded.
+// Words that expand to an empty string are dropped, as in other shells,
+// except the string in [[ string =~ regex ]] which may be empty.
+// eg. {"echo", "$HOME", "$UNSET", NULL} becomes {"echo", "/home/user", NULL}
+// flags is set to classify_word() of each new word, allocated in the arena.
+//
+char **expand_words(char **words, int **flags) {
+    int count = words_length(words);
+    char **new_words = malloc(sizeof (char *) * (count + 1));
+    *flags = arena_alloc(sizeof (int) * (count + 1));
+    int length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        int word_flags = classify_word(words[i]);
+        if (!(word_flags & (WORD_VARIABLE | WORD_ESCAPE))) {
+            (*flags)[length] = word_flags;
+            new_words[length++] = words[i];
+            continue;
+        }
+        char *word = (word_flags & WORD_ESCAPE) ? remove_escapes(words[i]) : words[i];
+        if (!(word_flags & WORD_VARIABLE)) {
+            (*flags)[length] = word_flags & ~WORD_ESCAPE;
+            new_words[length++] = word;
+            continue;
+        }
+        // What the variables held decides if the result needs globbing.
+        char *expanded = expand_word(word);
+        if (*expanded != '\0' || (i == 1 && strcmp(words[0], "[[") == 0)) {
+            (*flags)[length] = classify_word(expanded);
+            new_words[length++] = expanded;
+        }
+    }
+    new_words[length] = NULL;
+    return new_words;
+}
+
+//
+// Drops the backslash from each escaped special character or separator,
+// which tokenize left in so the character wasn't taken as an operator.
+// The result is allocated in the arena.
+// eg. "\\;" becomes ";" and "a\\ b" becomes "a b"
+//
+char *remove_escapes(char *word) {
+    char *result = arena_alloc(strlen(word) + 1);
+    char *out = result;
+    for (char *s = word; *s != '\0'; s++) {
+        if (s[0] == '\\' && s[1] != '\0' && strchr(SPECIAL_CHARS WORD_SEPARATORS, s[1]) != NULL) {
+            s++;
+        }
+        *out++ = *s;
+    }
+    *out = '\0';
+    return result;
+}
+
+// Expands every $NAME and ${...} in a word, the result is allocated in the arena.
+char *expand_word(char *word) {
+    size_t size = strlen(word) + 1;
+    size_t length = 0;
+    char *result = malloc(size);
+
+    char *s = word;
+    while (*s != '\0') {
+        char *value = NULL;
+        if (s[0] == '$' && s[1] == '{') {
+            // Find the matching brace so nested expansions stay together.
+            int depth = 0;
+            char *end = s + 1;
+            for (; *end != '\0'; end++) {
+                if (*end == '{') {
+                    depth++;
+                } else if (*end == '}' && --depth == 0) {
+                    break;
+                }
+            }
+            if (*end == '}') {
+                char *expr = strndup(s + 2, end - s - 2);
+                value = expand_parameter(expr);
+                free(expr);
+                s = end + 1;
+            }
+        } else if (s[0] == '$' && s[1] == '?') {
+            char *number = arena_alloc(16);
+            snprintf(number, 16, "%d", ctx->last_status);
+            value = number;
+            s += 2;
+        } else if (s[0] == '$' && (isalpha((unsigned char)s[1]) || s[1] == '_')) {
+            size_t name_length = 1;
+            while (isalnum((unsigned char)s[1 + name_length]) || s[1 + name_length] == '_') {
+                name_length++;
+            }
+            char *name = strndup(s + 1, name_length);
+            value = getenv(name);
+            if (value == NULL) {
+                value = "";
+            }
+            free(name);
+            s += name_length + 1;
+        }
+
+        // Anything that is not an expansion is copied as is.
+        size_t value_length;
+        if (value == NULL) {
+            value = s++;
+            value_length = 1;
+        } else {
+            value_length = strlen(value);
+        }
+        if (length + value_length + 1 > size) {
+            size = (length + value_length + 1) * 2;
+            result = realloc(result, size);
+        }
+        memcpy(result + length, value, value_length);
+        length += value_length;
+    }
+
+    char *expanded = arena_strndup(result, length);
+    free(result);
+    return expanded;
+}
+
+//
+// Evaluates the inside of a ${...} expansion.
+//
+//  * ${#var}                  length of var
+//  * ${var#pat} ${var##pat}   remove shortest/longest matching prefix
+//  * ${var%pat} ${var%%pat}   remove shortest/longest matching suffix
+//  * ${var/pat/rep}           replace first match, ${var//pat/rep} replaces all
+//  * ${var:off} ${var:off:len} substring, a negative len counts from the end
+//  * ${var:-word}             word if var is unset or empty
+//  * ${var^} ${var^^}         upper case first/all characters
+//  * ${var,} ${var,,}         lower case first/all characters
+//
+char *expand_parameter(char *expr) {
+    int is_length = 0;
+    if (expr[0] == '#' && expr[1] != '\0') {
+        is_length = 1;
+        expr++;
+    }
+
+    size_t name_length = 0;
+    if (isalpha((unsigned char)expr[0]) || expr[0] == '_') {
+        while (isalnum((unsigned char)expr[name_length]) || expr[name_length] == '_') {
+            name_length++;
+        }
+    }
+    if (name_length == 0 || (is_length && expr[name_length] != '\0')) {
+        fprintf(stderr, "${%s}: bad substitution\n", expr);
+        return "";
+    }
+
+    char *name = strndup(expr, name_length);
+    char *value = getenv(name);
+    free(name);
+    if (value == NULL) {
+        value = "";
+    }
+
+    char *op = expr + name_length;
+    size_t value_length = strlen(value);
+    if (is_length) {
+        char *number = arena_alloc(32);
+        snprintf(number, 32, "%zu", value_length);
+        return number;
+    }
+
+    switch (op[0]) {
+    case '\0':
+        return value;
+    case '#':
+    case '%':
+        if (op[1] == op[0]) {
+            return remove_match(value, expand_word(op + 2), op[0] == '%', 1);
+        }
+        return remove_match(value, expand_word(op + 1), op[0] == '%', 0);
+    case '/': {
+        int all = (op[1] == '/');
+        char *pattern = strdup(op + 1 + all);
+        char *replacement = strchr(pattern, '/');
+        if (replacement != NULL) {
+            *replacement++ = '\0';
+        } else {
+            replacement = "";
+        }
+        char *result = replace_match(value, expand_word(pattern), expand_word(replacement), all);
+        free(pattern);
+        return result;
+    }
+    case ':': {
+        if (op[1] == '-') {
+            return (*value != '\0') ? value : expand_word(op + 2);
+        }
+        char *endptr;
+        long offset = strtol(op + 1, &endptr, 10);
+        long length = (long)value_length;
+        if (*endptr == ':') {
+            length = strtol(endptr + 1, &endptr, 10);
+        }
+        if (*endptr != '\0') {
+            break;
+        }
+        if (offset < 0) {
+            offset += (long)value_length;
+        }
+        if (offset < 0 || offset > (long)value_length) {
+            return "";
+        }
+        if (length < 0) {
+            length = (long)value_length - offset + length;
+        }
+        if (length < 0) {
+            return "";
+        }
+        if (offset + length > (long)value_length) {
+            length = (long)value_length - offset;
+        }
+        return arena_strndup(value + offset, length);
+    }
+    case '^':
+    case ',': {
+        int all = (op[1] == op[0]);
+        if (op[1 + all] != '\0') {
+            break;
+        }
+        char *result = arena_strndup(value, value_length);
+        for (size_t i = 0; i < value_length && (all || i == 0); i++) {
+            result[i] = (op[0] == '^') ? toupper((unsigned char)result[i]) : tolower((unsigned char)result[i]);
+        }
+        return result;
+    }
+    }
+
+    fprintf(stderr, "${%s}: bad substitution\n", expr);
+    return "";
 }
 
 //
-// Splits the words array with NULL where the pipes are.
-// eg. {"seq", "2", "20", "|", "grep", "2", NULL} becomes {"seq", "2", "20", NULL, "grep", "2", NULL}
+// Removes the shortest or longest prefix (or suffix) of value matching pattern.
+// eg. remove_match("dir/file.c", "*/", 0, 0) returns "file.c"
 //
-char **split_words(char **words) {
-    int length = words_length(words);
-    for (int i = 0; i < length; i++) {
-        if (strcmp(words[i], "|") == 0) {
-            words[i] = NULL;
+char *remove_match(char *value, char *pattern, int suffix, int longest) {
+    size_t length = strlen(value);
+    char *candidate = malloc(length + 1);
+    char *result = value;
+
+    for (size_t i = 0; i <= length; i++) {
+        // Candidate lengths are tried in order of the match we want.
+        size_t match_length = longest ? length - i : i;
+        char *start = suffix ? value + length - match_length : value;
+        memcpy(candidate, start, match_length);
+        candidate[match_length] = '\0';
+        if (fnmatch(pattern, candidate, 0) == 0) {
+            if (suffix) {
+                result = arena_strndup(value, length - match_length);
+            } else {
+                result = value + match_length;
+            }
+            break;
         }
     }
-    return words;
+
+    free(candidate);
+    return result;
 }
 
-// Returns a pointer to the start of arguments for next pipe.
-char **next_pipe(char **words) {
-    char **start = words;
-    int i = 0;
-    while (1) {
-        if (words[i] == NULL) {
-            start = &words[i + 1];
-            return start;
+// Replaces the first (or every) longest match of pattern in value.
+char *replace_match(char *value, char *pattern, char *replacement, int all) {
+    size_t length = strlen(value);
+    if (*pattern == '\0') {
+        return value;
+    }
+
+    size_t replacement_length = strlen(replacement);
+    size_t size = length + 1;
+    size_t result_length = 0;
+    char *result = malloc(size);
+    char *candidate = malloc(length + 1);
+    int replaced = 0;
+
+    size_t i = 0;
+    while (i < length) {
+        size_t end = 0;
+        if (all || !replaced) {
+            for (end = length; end > i; end--) {
+                memcpy(candidate, value + i, end - i);
+                candidate[end - i] = '\0';
+                if (fnmatch(pattern, candidate, 0) == 0) {
+                    break;
+                }
+            }
+        }
+
+        if (end > i) {
+            if (result_length + replacement_length + length + 1 > size) {
+                size = (result_length + replacement_length + length + 1) * 2;
+                result = realloc(result, size);
+            }
+            memcpy(result + result_length, replacement, replacement_length);
+            result_length += replacement_length;
+            replaced = 1;
+            i = end;
+        } else {
+            if (result_length + 2 > size) {
+                size *= 2;
+                result = realloc(result, size);
+            }
+            result[result_length++] = value[i++];
         }
-        i++;
     }
+
+    char *replaced_value = arena_strndup(result, result_length);
+    free(candidate);
+    free(result);
+    return replaced_value;
 }
 
-// built-in commands implementations.
-void pwd(char **words) {
-    char pathname[MAX_LINE_CHARS];
-    if (getcwd(pathname, MAX_LINE_CHARS) == NULL) {
-        perror("getcwd");
-        return;
+// Checks if a word is a valid variable name.
+int is_assignment_name(char *word) {
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_') {
+        return 0;
     }
-    printf("current directory is '%s'\n", pathname);
-    return;
+    while (isalnum((unsigned char)*word) || *word == '_') {
+        word++;
+    }
+    return *word == '\0';
 }
 
-// Changes directory to specified argument.
-void cd(char **words) {
-    if (words[1] == NULL) {
-        chdir(getenv("HOME"));
+// Checks if a word is of the form NAME=value.
+int is_assignment(char *word) {
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_') {
+        return 0;
     }
-    else if (chdir(words[1]) != 0) {
-        fprintf(stderr, "cd: %s: No such file or directory\n", words[1]);
+    while (isalnum((unsigned char)*word) || *word == '_') {
+        word++;
     }
-    return;
+    return *word == '=';
 }
 
-// Error message if try to redirect built in command.
-void no_redirect (char *program) {
-    fprintf(stderr, "%s: I/O redirection not permitted for builtin commands\n", program);
+// Sets the variable in NAME=value so it is seen by expansions and children.
+void do_assignment(char **words) {
+    char *equals = strchr(words[0], '=');
+    char *name = strndup(words[0], equals - words[0]);
+    if (setenv(name, equals + 1, 1) != 0) {
+        perror("setenv");
+    }
+    forget_home(name);
+    free(name);
 }
 
 //
-// Returns path of file if it is in path.
-// If it is not found it will return NULL.
+// Evaluates [[ string =~ regex ]] and sets the exit status.
+// The tokenizer splits on | < > ! ( ) and ;, so everything after =~ is joined back
+// together, eg. {"[[", "ab", "=~", "(a", "|", "b)", "]]", NULL} matches "(a|b)".
 //
-int get_full_path(char *program, char **path, char full_path[MAX_LINE_CHARS]) {
-    // Next check if the file is in one of the path directories.
-    int i = 0;
-    while(path[i] != NULL) {
-        snprintf(full_path, MAX_LINE_CHARS, "%s/%s", path[i], program);
-        if (access(full_path, F_OK) != -1) {
-            return 1;
+void conditional(char **words) {
+    int length = words_length(words);
+    if (length < 5 || strcmp(words[length - 1], "]]") != 0 || strcmp(words[2], "=~") != 0) {
+        fprintf(stderr, "[[: expected [[ string =~ regex ]]\n");
+        ctx->last_status = 2;
+        return;
+    }
+
+    size_t pattern_length = 0;
+    for (int i = 3; i < length - 1; i++) {
+        pattern_length += strlen(words[i]);
+    }
+    char *pattern = malloc(pattern_length + 1);
+    pattern[0] = '\0';
+    for (int i = 3; i < length - 1; i++) {
+        strcat(pattern, words[i]);
+    }
+
+    ctx->last_status = regex_match(words[1], pattern);
+    free(pattern);
+}
+
+//
+// Matches string against an extended regular expression.
+// On a match MATCH is set to the whole match and MATCH_1 ... MATCH_9 to the groups,
+// without one they are all unset. Returns 0 on a match, 1 if there is no match and 2 if the regex is invalid.
+//
+int regex_match(char *string, char *pattern) {
+    regex_t *regex = regex_lookup(pattern);
+    if (regex == NULL) {
+        return 2;
+    }
+
+    char name[32];
+    regmatch_t groups[MAX_MATCH_GROUPS];
+    if (regexec(regex, string, MAX_MATCH_GROUPS, groups, 0) != 0) {
+        unsetenv("MATCH");
+        for (int i = 1; i <= ctx->match_groups_set; i++) {
+            snprintf(name, sizeof name, "MATCH_%d", i);
+            unsetenv(name);
         }
-        i++;
+        ctx->match_groups_set = 0;
+        return 1;
     }
-    // If not, we tell the user.
-    fprintf(stderr, "%s: command not found\n", program);
+
+    int groups_set = 0;
+    for (int i = 0; i < MAX_MATCH_GROUPS && i <= (int)regex->re_nsub; i++) {
+        char *group = "";
+        if (groups[i].rm_so != -1) {
+            group = strndup(string + groups[i].rm_so, groups[i].rm_eo - groups[i].rm_so);
+        }
+        if (i == 0) {
+            snprintf(name, sizeof name, "MATCH");
+        } else {
+            snprintf(name, sizeof name, "MATCH_%d", i);
+            groups_set = i;
+        }
+        setenv(name, group, 1);
+        if (groups[i].rm_so != -1) {
+            free(group);
+        }
+    }
+
+    // Groups from an earlier match must not be left behind.
+    for (int i = groups_set + 1; i <= ctx->match_groups_set; i++) {
+        snprintf(name, sizeof name, "MATCH_%d", i);
+        unsetenv(name);
+    }
+    ctx->match_groups_set = groups_set;
     return 0;
 }
 
-// Stores given command to ~/.jshell_history file.
-void store_command (char **words) {
-    // Need to get full path of home directory.
-    char *file_path = get_file_in_home(".jshell_history");
+// Returns the compiled form of pattern, compiling it only if it is not cached.
+regex_t *regex_lookup(char *pattern) {
+    unsigned long hash = hash_string(pattern);
+    struct regex_entry *oldest = &ctx->regex_cache[0];
 
-    // Now just open and append command with newline at the end.
-    FILE *fp = fopen(file_path, "a");
-    while (*words != NULL) {
-        fputs(*words++, fp);
-        fputc(' ', fp);
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++) {
+        struct regex_entry *entry = &ctx->regex_cache[i];
+        if (entry->pattern != NULL && entry->hash == hash && strcmp(entry->pattern, pattern) == 0) {
+            entry->last_used = ++ctx->regex_clock;
+            return &entry->regex;
+        }
+        if (entry->last_used < oldest->last_used) {
+            oldest = entry;
+        }
     }
-    fputc('\n', fp);
-    fclose(fp);
-    free(file_path);
+
+    regex_t regex;
+    int error = regcomp(&regex, pattern, REG_EXTENDED);
+    if (error != 0) {
+        char message[MAX_LINE_CHARS];
+        regerror(error, &regex, message, sizeof message);
+        fprintf(stderr, "[[: %s: %s\n", pattern, message);
+        return NULL;
+    }
+
+    // Replace the least recently used entry.
+    if (oldest->pattern != NULL) {
+        regfree(&oldest->regex);
+        free(oldest->pattern);
+    }
+    oldest->pattern = strdup(pattern);
+    oldest->hash = hash;
+    oldest->last_used = ++ctx->regex_clock;
+    oldest->regex = regex;
+    return &oldest->regex;
+}
+
+// djb2 hash of a string.
+unsigned long hash_string(char *s) {
+    unsigned long hash = 5381;
+    while (*s != '\0') {
+        hash = hash * 33 + (unsigned char)*s++;
+    }
+    return hash;
 }
 
 //
-// Does operations on last n commands depending on given mode.
-// If mode is EXECUTE, the nth command will be printed then executed.
-// If mode is PRINT, the last nth commands will be printed.
+// With no arguments prints every alias, with NAME prints that alias
+// and with NAME=value... defines it. The words after = are joined with spaces
+// and surrounding quotes are removed, eg. alias ll='ls -l'.
 //
-void last_n_commands(int number, int mode, char **environ, char **path) {
-    char *file_path = get_file_in_home(".jshell_history");
-    char line[MAX_LINE_CHARS]; 
-    int line_number = 0;
+void alias(char **words) {
+    if (words[1] == NULL) {
+        for (int i = 0; i < ALIAS_TABLE_SIZE; i++) {
+            for (struct alias *a = ctx->alias_table[i]; a != NULL; a = a->next) {
+                printf("alias %s='%s'\n", a->name, a->value);
+            }
+        }
+        ctx->last_status = 0;
+        return;
+    }
 
-    // Open file and move to avoid newline at the end.
-    FILE *fp = fopen(file_path, "r");
+    char *equals = strchr(words[1], '=');
+    if (equals == NULL) {
+        ctx->last_status = 0;
+        for (int i = 1; words[i] != NULL; i++) {
+            struct alias *a = alias_lookup(words[i]);
+            if (a == NULL) {
+                fprintf(stderr, "alias: %s: not found\n", words[i]);
+                ctx->last_status = 1;
+            } else {
+                printf("alias %s='%s'\n", a->name, a->value);
+            }
+        }
+        return;
+    }
 
-    // Count number of lines first.
-    int total_lines = line_count_file(fp);
-    if (number == -1) {
-        number = total_lines - 1;
+    size_t value_length = strlen(equals + 1);
+    for (int i = 2; words[i] != NULL; i++) {
+        value_length += strlen(words[i]) + 1;
+    }
+    char *value = malloc(value_length + 1);
+    strcpy(value, equals + 1);
+    for (int i = 2; words[i] != NULL; i++) {
+        strcat(value, " ");
+        strcat(value, words[i]);
     }
 
-    int start_line = total_lines - number; 
-    if (start_line < 0) {
-        start_line = 0;
+    // Strip matching quotes around the whole value.
+    char *start = value;
+    size_t length = strlen(start);
+    if (length >= 2 && (start[0] == '\'' || start[0] == '"') && start[length - 1] == start[0]) {
+        start[length - 1] = '\0';
+        start++;
     }
-    fseek(fp, 0, SEEK_SET);
 
-    // Loop through lines. 
-    while (line_number < total_lines) {
-        fgets(line, MAX_LINE_CHARS, fp);
-            if (mode == PRINT && line_number >= start_line) { 
-                printf("%d: %s", line_number, line);
-            } else if (mode == EXECUTE && line_number == number) {
-                printf("%s", line);
-                char **command_words = tokenize(line, WORD_SEPARATORS, SPECIAL_CHARS);
-                execute_command(command_words, path, environ);
-                free_tokens(command_words);
-                return;
-            }
-        line_number++;
+    char *name = strndup(words[1], equals - words[1]);
+    if (*name == '\0' || strpbrk(name, SPECIAL_CHARS "/") != NULL) {
+        fprintf(stderr, "alias: %s: invalid alias name\n", name);
+        ctx->last_status = 1;
+    } else {
+        alias_set(name, start);
+        ctx->last_status = 0;
     }
-    fclose(fp);
-    free(file_path);
+    free(name);
+    free(value);
 }
 
-// Prints last int(words[1]) commands.
-void print_history(char **words){
-    int length = words_length(words);
-    // Either print specified amount of the default (10).
-    if (words[1] != NULL) {
-        int number;
-        if (sscanf(words[1], "%d", &number) == 0) {
-            fprintf(stderr, "history: %s: numeric argument required\n", words[1]);
-            store_command(words);
-            return;
-        } else if (length > 2) {
-            fprintf(stderr, "history: too many arguments\n");
-            store_command(words);
-            return;
+// Removes each named alias.
+void unalias(char **words) {
+    if (words[1] == NULL) {
+        fprintf(stderr, "unalias: usage: unalias name [name ...]\n");
+        ctx->last_status = 2;
+        return;
+    }
+
+    ctx->last_status = 0;
+    for (int i = 1; words[i] != NULL; i++) {
+        struct alias **link = &ctx->alias_table[hash_string(words[i]) % ALIAS_TABLE_SIZE];
+        while (*link != NULL && strcmp((*link)->name, words[i]) != 0) {
+            link = &(*link)->next;
         }
-        last_n_commands(number, PRINT, NULL, NULL);
-    } else {
-        last_n_commands(10, PRINT, NULL, NULL);
+        if (*link == NULL) {
+            fprintf(stderr, "unalias: %s: not found\n", words[i]);
+            ctx->last_status = 1;
+            continue;
+        }
+        struct alias *a = *link;
+        *link = a->next;
+        free(a->name);
+        free(a->value);
+        free_tokens(a->tokens);
+        free(a);
     }
 }
 
-// Executes last int(words[1]) command.
-void execute_history(char **words, char **environment, char **path) {
-    if (words[1] != NULL) {
-        last_n_commands(atoi(words[1]), EXECUTE, environment, path);
+// Returns the alias with the given name or NULL if there is none.
+struct alias *alias_lookup(char *name) {
+    struct alias *a = ctx->alias_table[hash_string(name) % ALIAS_TABLE_SIZE];
+    while (a != NULL && strcmp(a->name, name) != 0) {
+        a = a->next;
+    }
+    return a;
+}
+
+// Defines or replaces an alias, tokenizing its value once here.
+void alias_set(char *name, char *value) {
+    struct alias *a = alias_lookup(name);
+    if (a == NULL) {
+        a = malloc(sizeof *a);
+        a->name = strdup(name);
+        unsigned long bucket = hash_string(name) % ALIAS_TABLE_SIZE;
+        a->next = ctx->alias_table[bucket];
+        ctx->alias_table[bucket] = a;
     } else {
-        last_n_commands(-1, EXECUTE, environment, path);
+        free(a->value);
+        free_tokens(a->tokens);
     }
+    a->value = strdup(value);
+    a->tokens = tokenize(value, WORD_SEPARATORS, SPECIAL_CHARS);
 }
 
-// Given an array of strings this will add globbed words to it.
-char **glob_words(char **words, int *is_globbed, glob_t *globbed_data) {
-    // Loop through all words and check if they need globbing.
-    // If so we must allocate new memory and add in the extra words.
-    for (int i = 1; words[i] != NULL; i++) {
-        if (strrchr (words[i], '*') != NULL || strrchr (words[i], '?') != NULL ||
-                strrchr (words[i], '[') != NULL || strrchr (words[i], '~') != NULL) {
+//
+// Replaces the first word of each pipeline stage with its alias, if any.
+// Aliases are expanded once, so alias ls='ls -F' does not loop.
+// The words array is freed and a new one returned, to be freed with free_tokens.
+// eg. with ll='ls -l' {"ll", "|", "wc", NULL} becomes {"ls", "-l", "|", "wc", NULL}
+//
+char **expand_aliases(char **words) {
+    // Nothing to do for the common case of no aliases matching.
+    int found = 0;
+    int command_start = 1;
+    int length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (command_start && alias_lookup(words[i]) != NULL) {
+            found = 1;
+        }
+        command_start = (strcmp(words[i], "|") == 0 || (i == 1 && strcmp(words[0], "<") == 0));
+        length++;
+    }
+    if (!found) {
+        return words;
+    }
 
-            *is_globbed = 1; // Necessary for knowing what to free at the end.
+    // Work out the new length before copying.
+    int new_length = 0;
+    command_start = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        struct alias *a = command_start ? alias_lookup(words[i]) : NULL;
+        new_length += a != NULL ? words_length(a->tokens) : 1;
+        command_start = (strcmp(words[i], "|") == 0 || (i == 1 && strcmp(words[0], "<") == 0));
+    }
 
-            // Run glob function and then allocate space for the globs.
-            glob(words[i], GLOB_NOCHECK|GLOB_TILDE, NULL, globbed_data);
-            int length = words_length(words);
-            char **new_words = malloc(sizeof (char**) * (globbed_data->gl_pathc + length + 1));
+    char **new_words = malloc(sizeof (char *) * (new_length + 1));
+    int n = 0;
+    command_start = 1;
+    for (int i = 0; i < length; i++) {
+        struct alias *a = command_start ? alias_lookup(words[i]) : NULL;
+        command_start = (strcmp(words[i], "|") == 0 || (i == 1 && strcmp(words[0], "<") == 0));
+        if (a == NULL) {
+            new_words[n++] = words[i];
+            continue;
+        }
+        for (int t = 0; a->tokens[t] != NULL; t++) {
+            new_words[n++] = strdup(a->tokens[t]);
+        }
+        free(words[i]);
+    }
+    new_words[n] = NULL;
+    free(words);
+    return new_words;
+}
 
-            // Save all words up to the word that need to be globbed.
-            for(int s = 0; s < i; s++) {
-                new_words[s] = words[s];
-            }
+// Allocates memory that lives until the enclosing arena_release.
+void *arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (ctx->arena_head == NULL || ctx->arena_head->size - ctx->arena_head->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        struct arena_block *block = malloc(sizeof *block + block_size);
+        assert(block != NULL);
+        block->next = ctx->arena_head;
+        block->used = 0;
+        block->size = block_size;
+        ctx->arena_head = block;
+    }
+    void *memory = ctx->arena_head->data + ctx->arena_head->used;
+    ctx->arena_head->used += size;
+    return memory;
+}
 
-            // Save all globs.
-            for(int s = i; s < globbed_data->gl_pathc + i; s++) {
-                new_words[s] = globbed_data->gl_pathv[s - i];
-            }
+// Copies length bytes of s into the arena and NUL-terminates them.
+char *arena_strndup(char *s, size_t length) {
+    char *copy = arena_alloc(length + 1);
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+    return copy;
+}
 
-            // Save everything after the globs.
-            for (int s = globbed_data->gl_pathc + i; s < globbed_data->gl_pathc + length; s++) {
-                new_words[s] = words[i + s + 1 - (globbed_data->gl_pathc + i)];
-            }
+// Remembers how much of the arena is in use.
+void arena_mark(struct arena_mark *mark) {
+    mark->block = ctx->arena_head;
+    mark->used = ctx->arena_head ? ctx->arena_head->used : 0;
+}
 
-            // Add null terminator and set to words.
-            new_words[globbed_data->gl_pathc + length] = NULL;
-            words = new_words;
-        }
+// Frees everything allocated in the arena since the mark was taken.
+void arena_release(struct arena_mark *mark) {
+    while (ctx->arena_head != mark->block) {
+        struct arena_block *next = ctx->arena_head->next;
+        free(ctx->arena_head);
+        ctx->arena_head = next;
+    }
+    if (ctx->arena_head != NULL) {
+        ctx->arena_head->used = mark->used;
     }
-    return words;
 }
 
 // Count number of lines in the file.
@@ -699,10 +6884,37 @@ int words_length(char **words) {
     return i;
 }
 
+// Joins words with single spaces into a malloc'd string.
+char *join_words(char **words) {
+    size_t size = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        size += strlen(words[i]) + 1;
+    }
+    char *joined = malloc(size);
+    size_t length = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        size_t word_length = strlen(words[i]);
+        if (i > 0) {
+            joined[length++] = ' ';
+        }
+        memcpy(joined + length, words[i], word_length);
+        length += word_length;
+    }
+    joined[length] = '\0';
+    return joined;
+}
+
 // Given a file name in home directory, this will return it's full path.
+// Without $HOME the home directory from the password database is used.
 char *get_file_in_home(char *filename) {
-    char *full_path = malloc(strlen(getenv("HOME")) + strlen(filename) + 2);
-    snprintf(full_path, strlen(getenv("HOME")) + strlen(filename) + 2, "%s/%s", getenv("HOME"), filename);
+    char *home = getenv("HOME");
+    if (home == NULL) {
+        struct passwd *entry = getpwuid(getuid());
+        home = (entry != NULL) ? entry->pw_dir : "/";
+    }
+    size_t size = strlen(home) + strlen(filename) + 2;
+    char *full_path = malloc(size);
+    snprintf(full_path, size, "%s/%s", home, filename);
     return full_path;
 }
 
@@ -755,9 +6967,152 @@ static void do_exit(char **words) {
         }
     }
 
+    // Only the library's caller may end its process.
+    if (ctx->embedded) {
+        ctx->last_status = exit_status;
+        return;
+    }
+
+    // exit() would move the shared stdin offset back to where the child's buffer was.
+    if (ctx->subshell) {
+        fflush(stdout);
+        fflush(stderr);
+        _exit(exit_status);
+    }
+
     exit(exit_status);
 }
 
+// Creates a context with its own PATH, aliases, caches and exit status.
+struct jsh_ctx *jsh_ctx_new(void) {
+    struct jsh_ctx *new_ctx = calloc(1, sizeof *new_ctx);
+    if (new_ctx == NULL) {
+        return NULL;
+    }
+    char *pathp = getenv("PATH");
+    if (pathp == NULL) {
+        pathp = DEFAULT_PATH;
+    }
+    new_ctx->path = tokenize(pathp, ":", "");
+    new_ctx->fds[0] = new_ctx->fds[1] = new_ctx->fds[2] = -1;
+    new_ctx->embedded = 1;
+    return new_ctx;
+}
+
+// Frees a context and everything it owns.
+void jsh_ctx_free(struct jsh_ctx *old_ctx) {
+    if (old_ctx == NULL) {
+        return;
+    }
+    for (int i = 0; i < ALIAS_TABLE_SIZE; i++) {
+        struct alias *a = old_ctx->alias_table[i];
+        while (a != NULL) {
+            struct alias *next = a->next;
+            free(a->name);
+            free(a->value);
+            free_tokens(a->tokens);
+            free(a);
+            a = next;
+        }
+    }
+    for (int i = 0; i < REGEX_CACHE_SIZE; i++) {
+        if (old_ctx->regex_cache[i].pattern != NULL) {
+            regfree(&old_ctx->regex_cache[i].regex);
+            free(old_ctx->regex_cache[i].pattern);
+        }
+    }
+    free(old_ctx->home);
+    if (old_ctx->resolved != NULL) {
+        free_tokens(old_ctx->resolved);
+    }
+    free(old_ctx->logged_command);
+    free(old_ctx->logged_cwd);
+    while (old_ctx->arena_head != NULL) {
+        struct arena_block *next = old_ctx->arena_head->next;
+        free(old_ctx->arena_head);
+        old_ctx->arena_head = next;
+    }
+    free_tokens(old_ctx->path);
+    free(old_ctx);
+}
+
+//
+// Runs one line in a context and returns its exit status.
+// fds gives the stdin, stdout and stderr of the commands, NULL or -1 to inherit.
+// Lines share the process's variables and directory, so they run one at a time.
+//
+int jsh_run(struct jsh_ctx *run_ctx, const char *line, const int fds[3]) {
+    extern char **environ;
+    static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&run_lock);
+    cwd_init();
+    struct jsh_ctx *old_ctx = ctx;
+    ctx = run_ctx;
+    for (int i = 0; i < 3; i++) {
+        ctx->fds[i] = fds != NULL ? fds[i] : -1;
+    }
+
+    char *line_copy = strdup(line);
+    run_line(line_copy, ctx->path, environ);
+    free(line_copy);
+
+    int status = ctx->last_status;
+    ctx = old_ctx;
+    pthread_mutex_unlock(&run_lock);
+    return status;
+}
+
+// Everything a thread started by jsh_run_async needs.
+struct jsh_job {
+    struct jsh_ctx *ctx;
+    char *line;
+    int fds[3];
+    int has_fds;
+    jsh_callback callback;
+    void *data;
+};
+
+static void *jsh_job_thread(void *arg) {
+    struct jsh_job *job = arg;
+    int status = jsh_run(job->ctx, job->line, job->has_fds ? job->fds : NULL);
+    if (job->callback != NULL) {
+        job->callback(job->ctx, status, job->data);
+    }
+    free(job->line);
+    free(job);
+    return NULL;
+}
+
+//
+// Runs a line on a new thread and calls callback with its exit status.
+// Returns 0 if the thread could not be started.
+//
+int jsh_run_async(struct jsh_ctx *run_ctx, const char *line, const int fds[3],
+        jsh_callback callback, void *data) {
+    struct jsh_job *job = malloc(sizeof *job);
+    job->ctx = run_ctx;
+    job->line = strdup(line);
+    job->has_fds = fds != NULL;
+    for (int i = 0; i < 3; i++) {
+        job->fds[i] = fds != NULL ? fds[i] : -1;
+    }
+    job->callback = callback;
+    job->data = data;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int started = pthread_create(&thread, &attr, jsh_job_thread, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        free(job->line);
+        free(job);
+    }
+    return started;
+}
+
 //
 // Check whether this process can execute a file.
 // Use this function when searching through the directories
@@ -767,11 +7122,11 @@ static int is_executable(char *pathname) {
     struct stat s;
     return
         // does the file exist?
-        stat(pathname, &s) == 0 &&
+        fstatat(cwd_dir(), pathname, &s, 0) == 0 &&
         // is the file a regular file?
         S_ISREG(s.st_mode) &&
         // can we execute it?
-        faccessat(AT_FDCWD, pathname, X_OK, AT_EACCESS) == 0;
+        faccessat(cwd_dir(), pathname, X_OK, AT_EACCESS) == 0;
 }
 
 //
@@ -801,13 +7156,19 @@ static char **tokenize(char *s, char *separators, char *special_chars) {
             break;
         }
 
-        size_t token_length = strcspn(s, separators);
-        size_t token_length_without_special_chars = strcspn(s, special_chars);
-        if (token_length_without_special_chars == 0) {
-            token_length_without_special_chars = 1;
-        }
-        if (token_length_without_special_chars < token_length) {
-            token_length = token_length_without_special_chars;
+        // A special character is a word by itself. Otherwise the word runs to
+        // the next separator or special character, and a backslash keeps the
+        // character after it in the word. The backslash stays until expansion.
+        size_t token_length = 1;
+        if (strchr(special_chars, *s) == NULL) {
+            token_length = 0;
+            while (s[token_length] != '\0' && strchr(separators, s[token_length]) == NULL &&
+                    strchr(special_chars, s[token_length]) == NULL) {
+                if (*special_chars != '\0' && s[token_length] == '\\' && s[token_length + 1] != '\0') {
+                    token_length++;
+                }
+                token_length++;
+            }
         }
         char *token = strndup(s, token_length);
         assert(token != NULL);
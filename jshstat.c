@@ -0,0 +1,153 @@
+// jshstat prints the counters published by running jsh sessions.
+//
+// Usage: jshstat [-s]
+//     -s  also print a line for each session
+//
+// Pages left behind by sessions that no longer exist, such as one killed by
+// a signal, are removed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "jshstat.h"
+
+// How many times a page being written is read again before it is skipped.
+#define READ_PAGE_TRIES 1000
+
+#define JSH_COUNTER_NAME(index, name) name,
+static const char *counter_names[JSH_COUNTERS] = {
+    JSH_COUNTER_LIST(JSH_COUNTER_NAME)
+};
+
+static int read_page(char *file_path, struct jsh_stats_page *copy);
+static void print_counters(char *label, long *counters);
+
+int main(int argc, char **argv) {
+    int per_session = 0;
+    if (argc == 2 && strcmp(argv[1], "-s") == 0) {
+        per_session = 1;
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-s]\n", argv[0]);
+        return 2;
+    }
+
+    DIR *dir = opendir(JSH_STATS_DIR);
+    if (dir == NULL) {
+        perror(JSH_STATS_DIR);
+        return 1;
+    }
+
+    // Header line.
+    printf("%-10s", "session");
+    for (int i = 0; i < JSH_COUNTERS; i++) {
+        printf(" %14s", counter_names[i]);
+    }
+    printf("\n");
+
+    long totals[JSH_COUNTERS] = {0};
+    int sessions = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, JSH_STATS_PREFIX, strlen(JSH_STATS_PREFIX)) != 0) {
+            continue;
+        }
+        char file_path[1024];
+        snprintf(file_path, sizeof file_path, "%s/%s", JSH_STATS_DIR, entry->d_name);
+
+        // The owner's pid is in the name, a session that died without
+        // removing its page may have left it mid-update.
+        char *end;
+        long pid = strtol(entry->d_name + strlen(JSH_STATS_PREFIX), &end, 10);
+        if (*end != '\0' || pid <= 0) {
+            continue;
+        }
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+            unlink(file_path);
+            continue;
+        }
+
+        struct jsh_stats_page page;
+        int result = read_page(file_path, &page);
+        if (result == -1) {
+            fprintf(stderr, "%s: %s: torn, still being written\n", argv[0], file_path);
+        }
+        if (result != 1) {
+            continue;
+        }
+
+        sessions++;
+        for (int i = 0; i < JSH_COUNTERS; i++) {
+            totals[i] += page.counters[i];
+        }
+        if (per_session) {
+            char label[32];
+            snprintf(label, sizeof label, "%d", page.pid);
+            print_counters(label, page.counters);
+        }
+    }
+    closedir(dir);
+
+    char label[32];
+    snprintf(label, sizeof label, "total(%d)", sessions);
+    print_counters(label, totals);
+    return 0;
+}
+
+//
+// Copies a consistent snapshot of a page. Returns 1 on success, 0 if it is
+// not a valid page and -1 if it was still being written after READ_PAGE_TRIES.
+//
+static int read_page(char *file_path, struct jsh_stats_page *copy) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    struct stat s;
+    if (fstat(fd, &s) == -1 || s.st_size < (off_t)sizeof *copy) {
+        close(fd);
+        return 0;
+    }
+    struct jsh_stats_page *page = mmap(NULL, sizeof *page, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        return 0;
+    }
+
+    int valid = page->magic == JSH_STATS_MAGIC && page->version == JSH_STATS_VERSION;
+    for (int tries = 0; valid; tries++) {
+        if (tries == READ_PAGE_TRIES) {
+            valid = -1;
+            break;
+        }
+        unsigned int seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, page, sizeof *copy);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+        sched_yield();
+    }
+    munmap(page, sizeof *page);
+    return valid;
+}
+
+// Prints one row of counters.
+static void print_counters(char *label, long *counters) {
+    printf("%-10s", label);
+    for (int i = 0; i < JSH_COUNTERS; i++) {
+        printf(" %14ld", counters[i]);
+    }
+    printf("\n");
+}
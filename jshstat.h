@@ -0,0 +1,41 @@
+// jshstat.h layout of the metrics page each jsh publishes in /dev/shm.
+//
+// The page is updated under a sequence lock: the writer makes seq odd,
+// updates the counters and makes seq even again. Readers copy the counters
+// and retry if seq was odd or changed while they were copying.
+
+#ifndef JSHSTAT_H
+#define JSHSTAT_H
+
+#define JSH_STATS_DIR "/dev/shm"
+#define JSH_STATS_PREFIX "jsh."
+#define JSH_STATS_MAGIC 0x4a534853
+#define JSH_STATS_VERSION 1
+
+// Each counter's index and the name jshstat prints for it.
+#define JSH_COUNTER_LIST(X) \
+    X(JSH_COMMANDS, "commands") \
+    X(JSH_SPAWNS, "spawns") \
+    X(JSH_SPAWN_FAILURES, "spawn_failures") \
+    X(JSH_PATH_HITS, "path_hits") \
+    X(JSH_PATH_MISSES, "path_misses") \
+    X(JSH_GLOB_CALLS, "glob_calls") \
+    X(JSH_GLOB_PATHS, "glob_paths") \
+    X(JSH_HISTORY_BYTES, "history_bytes") \
+    X(JSH_JOBS, "jobs")
+
+#define JSH_COUNTER_INDEX(index, name) index,
+enum jsh_counter {
+    JSH_COUNTER_LIST(JSH_COUNTER_INDEX)
+    JSH_COUNTERS
+};
+
+struct jsh_stats_page {
+    unsigned int magic;
+    unsigned int version;
+    int pid;
+    unsigned int seq;
+    long counters[JSH_COUNTERS];
+};
+
+#endif